@@ -0,0 +1,56 @@
+#ifndef FFLD_CELLKERNELS_H
+#define FFLD_CELLKERNELS_H
+
+namespace FFLD
+{
+/// Vectorized kernels over contiguous arrays of floats, used for the 352 dimensional SHOT cells
+/// (or for several consecutive cells at once, as the cells of a Tensor3D are contiguous).
+/// The SSE, AVX2 or AVX-512 implementation is selected once at startup from the features of the
+/// processor, the plain C++ one is used on other architectures.
+namespace CellKernels
+{
+/// Returns the dot product of @p a and @p b.
+float Dot(const float * a, const float * b, int n);
+
+/// Computes <tt>y += alpha * x</tt>.
+void Axpy(float alpha, const float * x, float * y, int n);
+
+/// Computes <tt>x *= alpha</tt>.
+void Scale(float alpha, float * x, int n);
+
+/// Returns the squared euclidean distance between @p a and @p b.
+float SquaredDistance(const float * a, const float * b, int n);
+
+/// Returns the chi-square distance <tt>sum (a - b)^2 / (|a| + |b|)</tt> between @p a and @p b.
+/// @note The terms with a null denominator are skipped.
+float ChiSquare(const float * a, const float * b, int n);
+
+/// Returns the EMD-hat between the histograms @p p and @p q for the thresholded ground distance
+/// <tt>min(|i - j|, threshold)</tt>, the same as emd_hat_gd_metric with that cost matrix, in
+/// O(n^2) time and without any allocation (for n up to 64).
+/// The surplus of the heavier histogram is dropped for free, and charged
+/// <tt>extraMassPenalty</tt> per unit.
+/// @note Not vectorized, meant for the 11 bins of a SHOT sub-histogram.
+float ThresholdedEMD(const float * p, const float * q, int n, float threshold,
+					 float extraMassPenalty);
+
+/// Number of lines transformed together by DistanceTransform().
+const int DTLanes = 16;
+
+/// Computes the generalized distance transform <tt>y[q] = max_p f[p] + (a (q - p) + b) (q - p)</tt>
+/// (with <tt>a < 0</tt>) of DTLanes lines of @p n values at once, using the lower envelope of
+/// parabolas of Felzenszwalb and Huttenlocher. The lines are interleaved (value q of line l at
+/// index <tt>q * DTLanes + l</tt>), and so are the optimal p written to @p m.
+/// @p t holds <tt>1 / (a d)</tt> for <tt>0 < d < n</tt>, @p z and @p v are buffers of
+/// <tt>(n + 1) * DTLanes</tt> and <tt>n * DTLanes</tt> elements.
+/// @note The lanes advance in lockstep, gathering their envelopes (AVX2 and AVX-512), and give
+/// the same results whatever the instruction set.
+void DistanceTransform(const float * f, int n, float a, float b, const float * t, float * z,
+					   int * v, float * y, int * m);
+
+/// Returns the name of the selected instruction set ("avx512", "avx2", "sse" or "scalar").
+const char * InstructionSet();
+}
+}
+
+#endif
@@ -17,6 +17,8 @@
 #include <pcl/filters/uniform_sampling.h>
 #include <pcl/features/normal_3d_omp.h>
 #include <pcl/features/shot_omp.h>
+#include <pcl/features/shot_lrf_omp.h>
+#include <pcl/search/kdtree.h>
 #include <pcl/common/common_headers.h>
 #include <pcl/common/transforms.h>
 #include <pcl/filters/voxel_grid.h>
@@ -127,8 +129,58 @@ namespace FFLD
         /// @note Scales are given by the following formula: 2^(1 - @c index / @c interval).
         const vector<vector<Level> > &levels() const;
 
+        /// Returns the squared norms of the cells of every box ([lvl][box]), computed along with the
+        /// levels (used by the RBF convolutions).
+        const vector<vector<Tensor3DF> > & squaredNorms() const;
+
+        /// Recomputes squaredNorms(), needed only after modifying levels_ directly.
+        void computeSquaredNorms();
+
         const std::vector<float> & resolutions() const;
         
+        /** CACHE **/
+
+        /// Version of the binary format written by operator<<. Bump it whenever the layout changes
+        /// so that stale cache files are rebuilt instead of misread.
+        static const int BinaryVersion = 1;
+
+        /// Writes the pyramid to @p filename in the binary format of operator<<.
+        /// @returns Whether the file could be written.
+        bool save(const std::string & filename) const;
+
+        /// Memory maps @p filename and reads the pyramid from it (the cells of each box are copied
+        /// out of the mapping).
+        /// @returns Whether @p filename exists and holds a valid pyramid of the current version, with
+        /// the interval and number of octaves the pyramid was constructed with.
+        /// @note The pyramid stays unmodified on failure.
+        bool load(const std::string & filename);
+
+        /// Restricts the pyramid to the boxes whose global descriptor scores at least
+        /// @p accuracyThreshold with @p rootFilter, i.e. turns a full pyramid into the one
+        /// createFilteredPyramid() would build with the same density threshold.
+        void filterBoxes(const Level & rootFilter, float accuracyThreshold);
+
+        /// Makes the pyramid the boxes of @p pyramid that filterBoxes(rootFilter, accuracyThreshold)
+        /// would keep. Only the kept boxes are copied, @p pyramid is left untouched.
+        void filterBoxes(const GSHOTPyramid & pyramid, const Level & rootFilter,
+                         float accuracyThreshold);
+
+        /// Sets the directory where the pyramids are cached on disk (empty disables the cache, the
+        /// default). The directory is created if needed.
+        static void SetCacheDirectory(const std::string & directory);
+
+        /// Returns the directory where the pyramids are cached on disk (empty if disabled).
+        static const std::string & CacheDirectory();
+
+        /// Returns the cache file of the pyramid built from the cloud file @p filename with the given
+        /// parameters, or an empty string if the cache is disabled or @p filename cannot be read.
+        /// The key includes a hash of the content of @p filename, not only its path.
+        /// @param[in] variant Distinguishes pyramids built from a part of the cloud (e.g. positives).
+        static std::string CachePath(const std::string & filename, float resolution,
+                                     Eigen::Vector3i filterSizes, int nbParts, int interval,
+                                     int nbOctave, int densityThreshold,
+                                     const std::string & variant = std::string());
+
         /** OTHERS **/
     
         
@@ -137,8 +189,22 @@ namespace FFLD
         /// @param[out] convolutions Convolution of each level.
         void convolve(const Level & filter, vector<vector<Tensor3DF> > &convolutions) const;
 
+        /// Returns the convolutions of the pyramid with several filters. The filters of identical
+        /// dimensions are applied together, as a single matrix product per batch of boxes when the
+        /// boxes of a level share their dimensions, or else per box.
+        /// @param[in] filters Filters.
+        /// @param[out] convolutions Convolution of each filter, level and box ([filter][lvl][box]).
+        void convolve(const std::vector<const Level *> & filters,
+                      vector<vector<vector<Tensor3DF> > > & convolutions) const;
+
         void sumConvolve(const Level & filter, vector<Tensor3DF >& convolutions) const;
 
+        /// Returns the RBF convolutions (see Tensor3D::RBFconvolve) of the pyramid with a filter,
+        /// reusing the squared norms of the cells.
+        /// @param[in] filter Filter.
+        /// @param[out] convolutions Convolution of each level and box ([lvl][box]).
+        void RBFconvolve(const Level & filter, vector<vector<Tensor3DF> > & convolutions) const;
+
         /// Maps a const pyramid level to a simple const matrix (useful to apply standard matrix
         /// operations to it).
         /// @note The size of the matrix will be rows x (cols * NbFeatures).
@@ -154,9 +220,24 @@ namespace FFLD
                                                      const Eigen::Vector3f origin,
                                                      const Eigen::Vector3f translation = Eigen::Vector3f(0,0,0));
         
+        /// Computes the normals and the search tree of the scene surface once. Every following call
+        /// to compute_descriptor() with the same @p surface shares them read-only (also across threads).
+        /// @param[in] surface The (downsampled) point cloud of the scene.
+        void setSearchSurface(PointCloudPtr surface);
+
+        /// Returns the normals computed by setSearchSurface() (empty if no surface was set).
+        SurfaceNormalsConstPtr surfaceNormals() const;
+
         // Method for computing feature spaces. May have different implementations depending on the descriptor used.
+        // Reuses the normals and search tree of setSearchSurface() if @p input is that surface.
+        // Set @p parallel to use the OMP variant of the estimators (for large keypoint clouds).
         DescriptorsPtr
-        compute_descriptor(PointCloudPtr input, PointCloudPtr keypoints, float);
+        compute_descriptor(PointCloudPtr input, PointCloudPtr keypoints, float, bool parallel = false);
+
+        /// Computes the descriptors of the keypoints of all the boxes of a level in a single parallel
+        /// SHOT pass and scatters them back into levels_[lvl][box].
+        /// @note keyPts_[lvl] must hold topology_[lvl] keypoints per box.
+        void computeBoxesDescriptors(PointCloudPtr input, int lvl, float descr_rad);
         
         PointCloudPtr computeKeyptsWithThresh(PointCloudPtr cloud, float grid_reso, PointType min, PointType max,
                                               Eigen::Vector3i filterSizes, int thresh);
@@ -168,8 +249,22 @@ namespace FFLD
         /*static */PointCloudPtr
         compute_keypoints(float grid_reso, PointType min, PointType max, int index);
         
-        // Computes the 2D convolution of a pyramid level with a filter
+        // Computes the 3D convolution of a pyramid level with a filter
         static void Convolve(const Level & level, const Level & filter, Tensor3DF & convolution);
+
+        // Computes the 3D convolutions of a pyramid level with filters of identical dimensions. The
+        // level is unrolled im2col-style (one row per output position) and multiplied by the matrix
+        // of the flattened filters (one column per filter).
+        static void Convolve(const Level & level, const std::vector<const Level *> & filters,
+                             std::vector<Tensor3DF> & convolutions);
+
+        // Same as above for a batch of boxes of identical dimensions. The patches of all the boxes
+        // are stacked in @p patches ([box][z][y][x][feature], reused across calls) so that the whole
+        // batch is a single matrix product. The convolution of filter i with box b is
+        // convolutions[i * nbBoxes + b].
+        static void Convolve(const Level * const * boxes, int nbBoxes,
+                             const std::vector<const Level *> & filters,
+                             std::vector<Tensor3DF> & convolutions, Matrix & patches);
         
 //        // Number of keypoints per dimension (needed for the sliding box process)
         std::vector<Eigen::Vector3i, Eigen::aligned_allocator<Eigen::Vector3i> > topology_;//number of points at [lvl]
@@ -181,6 +276,7 @@ namespace FFLD
         // Represent a vector of 3D scene of descriptors computed at different resolution
         //from 0 (original resolution) to n (lowest resolution, last octave)
         std::vector<std::vector<Level> > levels_;//[lvl][box]
+        std::vector<std::vector<Tensor3DF> > squaredNorms_;//[lvl][box], squared norms of the cells
 
         std::vector<float> resolutions_;
 
@@ -192,6 +288,11 @@ namespace FFLD
         PointCloudPtr globalKeyPts;
         DescriptorsPtr globalDescriptors;
 
+        // Per scene data shared by all the descriptor computations (see setSearchSurface)
+        PointCloudPtr surface_;
+        SurfaceNormalsPtr surfaceNormals_;
+        pcl::search::KdTree<PointType>::Ptr surfaceTree_;
+
         Eigen::Vector3i filterSizes_;
 
         Eigen::Vector3i sceneOffset_;
@@ -201,10 +302,13 @@ namespace FFLD
     int readPointCloud(std::string object_path, PointCloudPtr point_cloud);
     int readPointCloud(std::string object_path, PointCloudAPtr point_cloud);
 
-    /// Serializes a pyramid to a stream.
+    /// Serializes a pyramid to a stream (binary, open the stream with std::ios::binary).
+    /// @note The descriptor blocks are aligned in the stream, a mapped file is read with a single
+    /// aligned copy per box.
     std::ostream & operator<<(std::ostream & os, const GSHOTPyramid & pyramid);
     
-    /// Unserializes a pyramid from a stream.
+    /// Unserializes a pyramid from a stream written by operator<<.
+    /// @note Sets the failbit of the stream if it does not hold a valid pyramid.
     std::istream & operator>>(std::istream & is, GSHOTPyramid & pyramid);
 }
 
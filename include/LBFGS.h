@@ -65,6 +65,27 @@ public:
 							  double gnorm, double step, int t, int ls) const;
 	};
 	
+	/// Callback interface of the functions which can be evaluated cheaply along a fixed direction,
+	/// such as the losses of linear classifiers whose margins are affine in the step. The
+	/// line-searches then only need one full evaluation per iteration, for the gradient of the
+	/// solution found.
+	class IDirectionalFunction : public IFunction
+	{
+	public:
+		/// Sets the direction of the next evaluations.
+		/// @param[in] x Current solution.
+		/// @param[in] z Direction, the solutions evaluated are <tt>x - step * z</tt>.
+		virtual void direction(const double * x, const double * z) const = 0;
+		
+		/// Provides objective function evaluations along the current direction.
+		/// @param[in] step Step along the direction.
+		/// @param[out] slope Derivative of the objective function with respect to the step
+		/// (<tt>-z.g</tt>).
+		/// @param[out] g The gradient vector, computed only if not null.
+		/// @returns The value of the objective function for <tt>x - step * z</tt>.
+		virtual double line(double step, double & slope, double * g = 0) const = 0;
+	};
+	
 public:
 	/// Constructor.
 	/// @param[in] function Callback function to provide objective function and gradient
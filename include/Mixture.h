@@ -2,7 +2,9 @@
 #define FFLD_MIXTURE_H
 
 #include "Model.h"
+#include "Patchwork.h"
 #include "Scene.h"
+#include "SceneCache.h"
 #include "viewer.h"
 
 
@@ -38,8 +40,15 @@ struct NegSort{
 class Mixture
 {
 public:
-	/// Type of a matrix of indices.
-    typedef Tensor3DI Indices;
+	/// Type of the matrices of indices of all the boxes of a pyramid level.
+    typedef Tensor3DPackI Indices;
+	
+	/// Solvers of the SVM with fixed latent variables.
+	enum Solver
+	{
+		LBFGS_PRIMAL, ///< L-BFGS on the primal hinge loss.
+		DUAL_COORDINATE_DESCENT ///< Dual coordinate descent with shrinking, as in LIBLINEAR.
+	};
 
 	/// Constructs an empty mixture. An empty mixture has no model.
 	Mixture();
@@ -62,6 +71,7 @@ public:
 	const std::vector<Model> & models() const;
 	
 	/// Returns the list of models (mixture components).
+	/// @note Invalidates the cached filter transforms.
 	std::vector<Model> & models();
 	
 	/// Returns the minimum root filter size (<tt>rows x cols</tt>).
@@ -82,11 +92,18 @@ public:
 	/// @param[in] C Regularization constant of the SVM.
 	/// @param[in] J Weighting factor of the positives.
 	/// @param[in] overlap Minimum overlap in latent positive search.
+	/// @param[in] negOverlap Maximum overlap of the negatives with the objects.
+	/// @param[in] solver Solver of the SVM.
 	/// @returns The final SVM loss.
 	/// @note The magic constants come from Felzenszwalb's implementation.
     double train(const std::vector<Scene> & scenes, Object::Name name, int nbParts,
                  int interval = 5, int nbRelabel = 5, int nbDatamine = 10, int maxNegatives = 24000,
-                 double C = 0.002, double J = 2.0, double overlap = 0.4, float negOverlap = 0.5);
+                 double C = 0.002, double J = 2.0, double overlap = 0.4, float negOverlap = 0.5,
+                 Solver solver = LBFGS_PRIMAL);
+	
+	/// Returns the cache of the scene clouds and pyramids used during training. It is kept across
+	/// calls to train(), set its budget to 0 to disable it.
+	SceneCache & sceneCache() const;
 	
 	/// Initializes the specidied number of parts from the root of each model.
 	/// @param[in] nbParts Number of parts (without the root).
@@ -96,15 +113,15 @@ public:
 	/// Returns the scores of the convolutions + distance transforms of the models with a
 	/// pyramid of features (useful to compute the SVM margins).
 	/// @param[in] pyramid Pyramid of features.
-	/// @param[out] scores Scores for each pyramid level.
+	/// @param[out] scores Scores for each pyramid level (<tt>scores[lvl][box](z, y, x)</tt>).
 	/// @param[out] argmaxes Indices of the best model (mixture component) for each pyramid
 	/// level.
 	/// @param[out] positions Positions of each part of each model for each pyramid level
 	/// (<tt>models x parts x levels</tt>).
     ///     //Replace convolve
-    void computeScores(const GSHOTPyramid & pyramid, vector<vector<Tensor3DF> > &scores,
+    void computeScores(const GSHOTPyramid & pyramid, vector<Tensor3DPackF> &scores,
                              vector<Indices> & argmaxes,
-                             vector<vector<vector<vector<Model::Positions> > > > *positions) const;
+                             vector<vector<vector<Model::LevelPositions> > > *positions) const;
 
 	
 //private:
@@ -123,13 +140,16 @@ public:
 	// Trains the mixture from positive and negative samples with fixed latent variables
     double trainSVM(const std::vector<std::pair<Model, int> > & positives,
 				 const std::vector<std::pair<Model, int> > & negatives, double C, double J,
-				 int maxIterations = 400);
+				 int maxIterations = 400, Solver solver = LBFGS_PRIMAL);
 	
 	// Returns the scores of the convolutions + distance transforms of the models with a pyramid of
 	// features (useful to compute the SVM margins)
     void convolve(const GSHOTPyramid & pyramid,
-                  vector<vector<vector<Tensor3DF> > >& scores,
-                  vector<vector<vector<vector<Model::Positions> > > > *positions = 0) const;
+                  vector<vector<Tensor3DPackF> >& scores,
+                  vector<vector<vector<Model::LevelPositions> > > *positions = 0) const;
+	
+	// Caches the filters of the models for the Fourier convolutions
+	void cacheFilters() const;
 	
 	// Computes the size of the roots of the models
     static Eigen::Vector3i FilterSizes(int nbComponents,
@@ -140,7 +160,10 @@ public:
 	std::vector<Model> models_;
 	
 	mutable bool cached_; // Whether the current filters have been cached
+	mutable std::vector<Patchwork::Filter> filterCache_; // Filters of all the models, in order
 	mutable bool zero_; // Whether the current filters are zero
+	
+	mutable SceneCache sceneCache_; // Clouds and pyramids of the training scenes
 };
 
 /// Serializes a mixture to a stream.
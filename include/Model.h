@@ -26,6 +26,9 @@ public:
 	/// Type of a matrix of 3d positions.
     typedef Tensor3D<Position> Positions;
 	
+	/// Type of the matrices of 3d positions of all the boxes of a pyramid level, in a single buffer.
+    typedef Tensor3DPack<Position> LevelPositions;
+	
 	/// Type of a 3d quadratic deformation (dx^2 dx dy^2 dy dz^2 dz).
     typedef Eigen::Array<double, 8, 1> Deformation;
 	
@@ -34,7 +37,7 @@ public:
 	{
         GSHOTPyramid::Level filter;
         Position offset;			///< Part offset (dz dy dx) relative to the root.
-		Deformation deformation;	///< Deformation cost (dx^2 dx dy^2 dy dz^2 dz).
+		Deformation deformation;	///< Deformation cost (dx^2 dx dy^2 dy dz^2 dz dlvl^2 dlvl).
 		EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 	};
 	
@@ -93,17 +96,21 @@ public:
 	/// @note The sample will be empty if any of the parameter is invalid or if any of the part
 	/// filter is unreachable.
     void initializeSample(const GSHOTPyramid & pyramid, int box, int z, int y, int x, int lvl, Model & sample,
-                          const vector<vector<vector<Positions> > >* positions = 0) const;
+                          const vector<vector<LevelPositions> >* positions = 0) const;
 	
     //Detection, energy computation
 	/// Returns the scores of the convolutions + distance transforms of the parts with a pyramid of
 	/// features.
 	/// @param[in] pyramid Pyramid of features.
-	/// @param[out] scores Scores for each pyramid level.
-	/// @param[out] positions Positions of each part and each pyramid level.
+	/// @param[out] scores Scores for each pyramid level (all the boxes of a level in one buffer,
+	/// <tt>scores[lvl][box](z, y, x)</tt>).
+	/// @param[out] positions Positions of each part and each pyramid level
+	/// (<tt>(*positions)[part][lvl][box](z, y, x)</tt>).
 	/// @param[in] Precomputed convolutions of each part and each pyramid level.
-    void convolve(const GSHOTPyramid & pyramid, vector<vector<Tensor3DF> > & scores,
-                  vector<vector<vector<Positions> > > *positions = 0,
+	/// @note The convolutions of the parts are transformed in place and released level by level.
+	/// With FFLD_MODEL_3D the parts can also move by up to an octave across the levels.
+    void convolve(const GSHOTPyramid & pyramid, vector<Tensor3DPackF> & scores,
+                  vector<vector<LevelPositions> > *positions = 0,
                   vector<vector<vector<Tensor3DF> > > *convolutions = 0) const;
 	
     //Similarity in the optimization process of the SVM
@@ -131,13 +138,42 @@ public:
 	/// @note Do not use with models, only with fixed samples.
     Model & operator*=(double a);
 	
+	/// Returns whether the filters and deformations of the model have the same sizes as the ones of
+	/// @p sample.
+	bool isCompatible(const Model & sample) const;
+	
+	/// Adds the filters, deformation costs, and bias of @p sample scaled by @p a in-place, without
+	/// any temporary (<tt>this += a * sample</tt>).
+	/// @note Do nothing if the models are incompatible, the sizes are checked before anything is
+	/// modified.
+	Model & axpy(double a, const Model & sample);
+	
+	/// Temporary buffers of the distance transforms. Keep one per thread and reuse it across calls,
+	/// it only grows when a larger tensor is transformed.
+	struct DTWorkspace
+	{
+		/// Grows the buffers for tensors of up to @p size cells and @p maxDim cells per dimension.
+		void reserve(int size, int maxDim);
+		
+		std::vector<GSHOTPyramid::Scalar> tmp1;		///< Transform of the rows.
+		std::vector<GSHOTPyramid::Scalar> tmp2;		///< Transform of the rows and columns.
+		std::vector<GSHOTPyramid::Scalar> t;		///< Inverses of the quadratic costs (x, y, z).
+		std::vector<GSHOTPyramid::Scalar> lines;	///< Tile of interleaved lines to transform.
+		std::vector<GSHOTPyramid::Scalar> transformed;	///< Tile of transformed lines.
+		std::vector<int> argmaxes;					///< Tile of optimal positions.
+		std::vector<GSHOTPyramid::Scalar> distance;	///< Boundaries between the parabolas.
+		std::vector<int> index;						///< Parabolas of the lower envelopes.
+	};
+	
     /// Computes an in-place 3D quadratic distance transform.
-	/// @param[in,out] matrix Matrix to tranform in-place.
+	/// @param[in,out] tensor Tensor to tranform in-place.
 	/// @param[in] part Part from which to read the deformation cost and offset.
-    /// @param tmp Temporary tensors.
-	/// @param[out] positions Optimal position of each part for each root location.
-    static void DT3D(Tensor3DF & tensor, const Part & part, Tensor3DF & tmp1, Tensor3DF & tmp2,
-                     Positions * positions = 0);
+	/// @param[in,out] workspace Temporary buffers, not shared between threads.
+	/// @param[out] positions Optimal position of each part for each root location, a buffer of
+	/// tensor.size() positions in the same order as the cells of the tensor (e.g. a box of
+	/// LevelPositions).
+    static void DT3D(Tensor3DF & tensor, const Part & part, DTWorkspace & workspace,
+                     Position * positions = 0);
 
     Eigen::Vector3i boxSize_;
 private:
@@ -0,0 +1,73 @@
+#ifndef FFLD_PATCHWORK_H
+#define FFLD_PATCHWORK_H
+
+#include "GSHOTPyramid.h"
+
+#include <complex>
+#include <map>
+#include <tuple>
+
+#include <fftw3.h>
+
+namespace FFLD
+{
+/// The Patchwork class computes the convolutions of the boxes of a pyramid with filters in the
+/// Fourier domain. The boxes of a level all have the same dimensions, so they are transformed
+/// with the same FFTW plan, all the feature channels at once. The filters are transformed once for
+/// each box size and the channels are summed in the Fourier domain, which leaves a single inverse
+/// transform per box and filter.
+/// @note The convolutions of 1x1x1 filters are plain dot products per cell and are computed with
+/// GSHOTPyramid::Convolve instead.
+class Patchwork
+{
+public:
+	/// Type of a complex number.
+	typedef std::complex<Scalar> Complex;
+	
+	/// Type of the transform of a box or of a filter (one row of channels per frequency).
+	typedef Eigen::Matrix<Complex, Eigen::Dynamic, GSHOTPyramid::DescriptorSize, Eigen::RowMajor>
+		Spectrum;
+	
+	/// Type of the dimensions of a box (<tt>depths rows cols</tt>).
+	typedef std::tuple<int, int, int> Size;
+	
+	/// Type of a transformed filter: the filter itself and its transform at each box size.
+	struct Filter
+	{
+		GSHOTPyramid::Level filter;
+		std::map<Size, Spectrum> spectra;
+	};
+	
+	/// Constructs a patchwork from a pyramid.
+	/// @note The pyramid must outlive the patchwork.
+	explicit Patchwork(const GSHOTPyramid & pyramid);
+	
+	/// Returns the sizes of the boxes of the pyramid.
+	const std::vector<Size> & sizes() const;
+	
+	/// Transforms the filters at the sizes of the boxes of the pyramid, if not already done.
+	/// @note Not thread safe, the filters are modified.
+	void transformFilters(std::vector<Filter> & filters) const;
+	
+	/// Returns the convolutions of the pyramid with the filters.
+	/// @param[in] filters Filters transformed by transformFilters().
+	/// @param[out] convolutions Convolution of each filter, level and box ([filter][lvl][box]).
+	void convolve(const std::vector<Filter> & filters,
+				  std::vector<std::vector<std::vector<Tensor3DF> > > & convolutions) const;
+	
+	/// Initializes a transformed filter (the transforms are computed by transformFilters()).
+	static void TransformFilter(const GSHOTPyramid::Level & filter, Filter & result);
+	
+private:
+	// Forward (all channels) and inverse (one channel) plans of a box size, created once
+	static std::pair<fftwf_plan, fftwf_plan> Plans(const Size & size);
+	
+	// Transforms all the channels of a box or of a filter zero padded to size
+	static void Transform(const GSHOTPyramid::Level & level, const Size & size, Spectrum & result);
+	
+	const GSHOTPyramid & pyramid_;
+	std::vector<Size> sizes_;
+};
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef FFLD_SCENECACHE_H
+#define FFLD_SCENECACHE_H
+
+#include "GSHOTPyramid.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+namespace FFLD
+{
+/// The SceneCache class keeps the point clouds and the pyramids of the training scenes in memory
+/// during a training session, so that the relabel and datamine iterations only re-score features
+/// that were already extracted. The least recently used entries are evicted once the estimated
+/// memory of the cache exceeds its budget.
+/// @note The cached clouds and pyramids are shared, they must not be modified.
+class SceneCache
+{
+public:
+	/// Type of a shared pyramid.
+	typedef boost::shared_ptr<const GSHOTPyramid> PyramidConstPtr;
+	
+	/// Default memory budget (4 GiB).
+	static const size_t DefaultBudget = size_t(4) << 30;
+	
+	/// Constructs an empty cache.
+	/// @param[in] budget Memory budget in bytes (0 disables the cache).
+	explicit SceneCache(size_t budget = DefaultBudget);
+	
+	/// Constructs a copy of @p cache, sharing its clouds and pyramids.
+	SceneCache(const SceneCache & cache);
+	
+	/// Replaces the entries by those of @p cache, sharing its clouds and pyramids.
+	SceneCache & operator=(const SceneCache & cache);
+	
+	/// Returns the memory budget in bytes.
+	size_t budget() const;
+	
+	/// Sets the memory budget in bytes, evicting entries if needed.
+	void setBudget(size_t budget);
+	
+	/// Returns the estimated memory used by the cached entries in bytes.
+	size_t bytes() const;
+	
+	/// Returns the point cloud of the file @p filename, reading it on the first call.
+	/// @returns An empty pointer if the file could not be read.
+	PointCloudPtr cloud(const std::string & filename);
+	
+	/// Returns the pyramid cached under @p key, or an empty pointer if there is none.
+	PyramidConstPtr pyramid(const std::string & key);
+	
+	/// Caches @p pyramid under @p key.
+	void insert(const std::string & key, PyramidConstPtr pyramid);
+	
+	/// Removes all the entries.
+	void clear();
+	
+	/// Returns the estimated memory used by a point cloud in bytes.
+	static size_t Bytes(const PointCloudT & cloud);
+	
+	/// Returns the estimated memory used by a pyramid (levels, keypoints, descriptors and search
+	/// surface) in bytes.
+	static size_t Bytes(const GSHOTPyramid & pyramid);
+	
+private:
+	struct Entry
+	{
+		PointCloudPtr cloud;
+		PyramidConstPtr pyramid;
+		size_t bytes;
+		std::list<std::string>::iterator lru;
+	};
+	
+	// Marks an entry as the most recently used one
+	void touch(Entry & entry);
+	
+	// Adds an entry and evicts the least recently used ones until the budget is met
+	void insert(const std::string & key, Entry entry);
+	
+	void evict();
+	
+	size_t budget_;
+	size_t bytes_;
+	std::map<std::string, Entry> entries_;
+	std::list<std::string> lru_; // Most recently used first
+};
+}
+
+#endif
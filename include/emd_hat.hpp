@@ -1,6 +1,7 @@
 #ifndef EMD_HAT_HPP
 #define EMD_HAT_HPP
 
+#include <cstddef>
 #include <vector>
 #include "EMD_DEFS.hpp"
 #include "flow_utils.hpp"
@@ -58,6 +59,63 @@ struct emd_hat {
 
 #include "emd_hat_impl.hpp"
 
+/// Stateful version of emd_hat_gd_metric<double> (distance only) that keeps the converted ground
+/// distance and all the buffers of the flow network between calls, so that solving many small
+/// problems does not go through the allocator. Not thread safe, use one instance per thread.
+///
+/// The histograms can be of any numeric type (e.g. float descriptors), they are converted in
+/// place of the std::vector<double> copies the functors need.
+class emd_hat_gd_metric_solver {
+public:
+
+    /// Sets the NxN ground distance matrix C (see emd_hat_gd_metric) of all the following calls.
+    void set_costs(const std::vector< std::vector<double> >& C) {
+        _N= C.size();
+        _impl.set_costs(C);
+    }
+
+    /// Returns the distance between the histograms P and Q of N bins.
+    template<typename IN_T>
+    double operator()(const IN_T* P, const IN_T* Q, double extra_mass_penalty= -1) {
+        _POrig.assign(P, P+_N);
+        _QOrig.assign(Q, Q+_N);
+        _P= _POrig;
+        _Q= _QOrig;
+
+        // Flows between identical bins are free (as in emd_hat_gd_metric)
+        {for (NODE_T i=0; i<_N; ++i) {
+            if (_P[i]<_Q[i]) {
+                _Q[i]-= _P[i];
+                _P[i]= 0;
+            } else {
+                _P[i]-= _Q[i];
+                _Q[i]= 0;
+            }
+        }}
+
+        return _impl.solve(_POrig,_QOrig,_P,_Q,extra_mass_penalty,NULL);
+    }
+
+    /// Computes the distances between nb_pairs pairs of histograms of N bins, stored one after the
+    /// other in P and Q.
+    template<typename IN_T>
+    void operator()(const IN_T* P, const IN_T* Q, int nb_pairs, double* distances,
+                    double extra_mass_penalty= -1) {
+        {for (int k=0; k<nb_pairs; ++k) {
+            distances[k]= (*this)(P+k*_N, Q+k*_N, extra_mass_penalty);
+        }}
+    }
+
+private:
+
+    NODE_T _N;
+    std::vector<double> _POrig;
+    std::vector<double> _QOrig;
+    std::vector<double> _P;
+    std::vector<double> _Q;
+    emd_hat_impl<double,NO_FLOW> _impl;
+};
+
 #endif
 
 // Copyright (c) 2009-2012, Ofir Pele
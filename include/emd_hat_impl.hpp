@@ -99,9 +99,9 @@ struct emd_hat_impl_integral_types {
     assert(Qc.size()==N);
 
     // Ensuring that the supplier - P, have more mass.
-    std::vector<NUM_T> P;
-    std::vector<NUM_T> Q;
-    std::vector< std::vector<NUM_T> > C(Cc);
+    std::vector<NUM_T>& P= _P;
+    std::vector<NUM_T>& Q= _Q;
+    const std::vector< std::vector<NUM_T> >* Cp= &Cc;
     NUM_T abs_diff_sum_P_sum_Q;
     NUM_T sum_P= 0;
     NUM_T sum_Q= 0;
@@ -113,11 +113,14 @@ struct emd_hat_impl_integral_types {
         P= Qc;
         Q= Pc;
         // transpose C
+        _C.resize(N);
         for (NODE_T i=0; i<N; ++i) {
+            _C[i].resize(N);
             for (NODE_T j=0; j<N; ++j) {
-                C[i][j]= Cc[j][i];
+                _C[i][j]= Cc[j][i];
             }
         }
+        Cp= &_C;
         abs_diff_sum_P_sum_Q= sum_Q-sum_P;
     } else {
         P= Pc;
@@ -125,9 +128,11 @@ struct emd_hat_impl_integral_types {
         abs_diff_sum_P_sum_Q= sum_P-sum_Q;
     }
     //if (needToSwapFlow) cout << "needToSwapFlow" << endl;
+    const std::vector< std::vector<NUM_T> >& C= *Cp;
     
     // creating the b vector that contains all vertexes
-    std::vector<NUM_T> b(2*N+2);
+    std::vector<NUM_T>& b= _b;
+    b.resize(2*N+2);
     const NODE_T THRESHOLD_NODE= 2*N;
     const NODE_T ARTIFICIAL_NODE= 2*N+1; // need to be last !
     {for (NODE_T i=0; i<N; ++i) {
@@ -159,8 +164,10 @@ struct emd_hat_impl_integral_types {
    
     
     //=============================================================
-    std::set< NODE_T > sources_that_flow_not_only_to_thresh; 
-    std::set< NODE_T > sinks_that_get_flow_not_only_from_thresh; 
+    std::vector< char >& sources_that_flow_not_only_to_thresh= _sources_that_flow_not_only_to_thresh;
+    std::vector< char >& sinks_that_get_flow_not_only_from_thresh= _sinks_that_get_flow_not_only_from_thresh;
+    sources_that_flow_not_only_to_thresh.assign(b.size(), false);
+    sinks_that_get_flow_not_only_from_thresh.assign(b.size(), false);
     NUM_T pre_flow_cost= 0;
     //=============================================================
 
@@ -168,7 +175,9 @@ struct emd_hat_impl_integral_types {
     
     //=============================================================
     // regular edges between sinks and sources without threshold edges
-    std::vector< std::list< edge<NUM_T> > > c(b.size());
+    std::vector< std::vector< edge<NUM_T> > >& c= _c;
+    c.resize(b.size());
+    {for (NODE_T i=0; i<c.size(); ++i) c[i].clear();}
     {for (NODE_T i=0; i<N; ++i) {
         if (b[i]==0) continue;
         {for (NODE_T j=0; j<N; ++j) {
@@ -184,8 +193,8 @@ struct emd_hat_impl_integral_types {
         {for (NODE_T j=0; j<N; ++j) {
             if (b[j+N]==0) continue;
             if (C[i][j]==maxC) continue;
-            sources_that_flow_not_only_to_thresh.insert(i);
-            sinks_that_get_flow_not_only_from_thresh.insert(j+N);
+            sources_that_flow_not_only_to_thresh[i]= true;
+            sinks_that_get_flow_not_only_from_thresh[j+N]= true;
         }} // j
     }}// i
 
@@ -225,13 +234,15 @@ struct emd_hat_impl_integral_types {
     // Note here it should be vector<int> and not vector<NODE_T>
     // as I'm using -1 as a special flag !!!
     const int REMOVE_NODE_FLAG= -1;
-    std::vector<int> nodes_new_names(b.size(),REMOVE_NODE_FLAG);
-    std::vector<int> nodes_old_names;
+    std::vector<int>& nodes_new_names= _nodes_new_names;
+    std::vector<int>& nodes_old_names= _nodes_old_names;
+    nodes_new_names.assign(b.size(),REMOVE_NODE_FLAG);
+    nodes_old_names.clear();
     nodes_old_names.reserve(b.size());
     {for (NODE_T i=0; i<N*2; ++i) {
             if (b[i]!=0) {
-             if (sources_that_flow_not_only_to_thresh.find(i)!=sources_that_flow_not_only_to_thresh.end()|| 
-                sinks_that_get_flow_not_only_from_thresh.find(i)!=sinks_that_get_flow_not_only_from_thresh.end()) {
+             if (sources_that_flow_not_only_to_thresh[i]|| 
+                sinks_that_get_flow_not_only_from_thresh[i]) {
                 nodes_new_names[i]= current_node_name;
                 nodes_old_names.push_back(i);
                 ++current_node_name;
@@ -250,7 +261,8 @@ struct emd_hat_impl_integral_types {
     nodes_old_names.push_back(ARTIFICIAL_NODE);
     ++current_node_name;
 
-    std::vector<NUM_T> bb(current_node_name);
+    std::vector<NUM_T>& bb= _bb;
+    bb.resize(current_node_name);
     NODE_T j=0;
     {for (NODE_T i=0; i<b.size(); ++i) {
         if (nodes_new_names[i]!=REMOVE_NODE_FLAG) {
@@ -259,10 +271,12 @@ struct emd_hat_impl_integral_types {
         }
     }}
         
-    std::vector< std::list< edge<NUM_T> > > cc(bb.size());
+    std::vector< std::vector< edge<NUM_T> > >& cc= _cc;
+    cc.resize(bb.size());
+    {for (NODE_T i=0; i<cc.size(); ++i) cc[i].clear();}
     {for (NODE_T i=0; i<c.size(); ++i) {
         if (nodes_new_names[i]==REMOVE_NODE_FLAG) continue;
-        {for (typename std::list< edge<NUM_T> >::const_iterator it= c[i].begin(); it!=c[i].end(); ++it) {
+        {for (typename std::vector< edge<NUM_T> >::const_iterator it= c[i].begin(); it!=c[i].end(); ++it) {
             if ( nodes_new_names[it->_to]!=REMOVE_NODE_FLAG) {
                 cc[ nodes_new_names[i] ].push_back( edge<NUM_T>( nodes_new_names[it->_to], it->_cost ) );
             }
@@ -277,11 +291,13 @@ struct emd_hat_impl_integral_types {
     #endif
 
     //-------------------------------------------------------
-    min_cost_flow<NUM_T> mcf;
+    min_cost_flow<NUM_T>& mcf= _mcf;
         
     NUM_T my_dist;
     
-    std::vector< std::list<  edge0<NUM_T>  > > flows(bb.size());
+    std::vector< std::vector<  edge0<NUM_T>  > >& flows= _flows;
+    flows.resize(bb.size());
+    {for (NODE_T i=0; i<flows.size(); ++i) flows[i].clear();}
 
     //std::cout << bb.size() << std::endl;
     //std::cout << cc.size() << std::endl;
@@ -294,7 +310,7 @@ struct emd_hat_impl_integral_types {
 
     if (FLOW_TYPE!=NO_FLOW) {
         for (NODE_T new_name_from=0; new_name_from<flows.size(); ++new_name_from) {
-            for (typename std::list<  edge0<NUM_T>  >::const_iterator it= flows[new_name_from].begin(); it!=flows[new_name_from].end(); ++it) {
+            for (typename std::vector<  edge0<NUM_T>  >::const_iterator it= flows[new_name_from].begin(); it!=flows[new_name_from].end(); ++it) {
                 if (new_name_from==nodes_new_names[THRESHOLD_NODE]||it->_to==nodes_new_names[THRESHOLD_NODE]) continue;
                 NODE_T i,j;
                 NUM_T flow= it->_flow;
@@ -331,6 +347,23 @@ struct emd_hat_impl_integral_types {
     //-------------------------------------------------------
     
 } // emd_hat_impl_integral_types (main implementation) operator()
+
+private:
+
+    // Buffers kept between calls, so that an instance solving many problems does not reallocate
+    std::vector<NUM_T> _P;
+    std::vector<NUM_T> _Q;
+    std::vector< std::vector<NUM_T> > _C;
+    std::vector<NUM_T> _b;
+    std::vector< char > _sources_that_flow_not_only_to_thresh;
+    std::vector< char > _sinks_that_get_flow_not_only_from_thresh;
+    std::vector< std::vector< edge<NUM_T> > > _c;
+    std::vector<int> _nodes_new_names;
+    std::vector<int> _nodes_old_names;
+    std::vector<NUM_T> _bb;
+    std::vector< std::vector< edge<NUM_T> > > _cc;
+    std::vector< std::vector<  edge0<NUM_T>  > > _flows;
+    min_cost_flow<NUM_T> _mcf;
 };
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
@@ -349,8 +382,12 @@ struct emd_hat_impl<int,FLOW_TYPE> {
         const std::vector< std::vector<NUM_T> >& C,
         NUM_T extra_mass_penalty,
         std::vector< std::vector<NUM_T> >* F) {
-        return emd_hat_impl_integral_types<NUM_T,FLOW_TYPE>()(POrig,QOrig,P,Q,C,extra_mass_penalty,F);
+        return _impl(POrig,QOrig,P,Q,C,extra_mass_penalty,F);
     }
+
+private:
+
+    emd_hat_impl_integral_types<NUM_T,FLOW_TYPE> _impl;
     
 }; // emd_hat_impl<int>
 
@@ -365,9 +402,13 @@ struct emd_hat_impl<long int,FLOW_TYPE> {
         const std::vector< std::vector<NUM_T> >& C,
         NUM_T extra_mass_penalty,
         std::vector< std::vector<NUM_T> >* F) {
-        return emd_hat_impl_integral_types<NUM_T,FLOW_TYPE>()(POrig,QOrig,P,Q,C,extra_mass_penalty,F);
+        return _impl(POrig,QOrig,P,Q,C,extra_mass_penalty,F);
     }
 
+private:
+
+    emd_hat_impl_integral_types<NUM_T,FLOW_TYPE> _impl;
+
     
 }; // emd_hat_impl<long int>
 
@@ -382,8 +423,12 @@ struct emd_hat_impl<long long int,FLOW_TYPE> {
         const std::vector< std::vector<NUM_T> >& C,
         NUM_T extra_mass_penalty,
         std::vector< std::vector<NUM_T> >* F) {
-        return emd_hat_impl_integral_types<NUM_T,FLOW_TYPE>()(POrig,QOrig,P,Q,C,extra_mass_penalty,F);
+        return _impl(POrig,QOrig,P,Q,C,extra_mass_penalty,F);
     }
+
+private:
+
+    emd_hat_impl_integral_types<NUM_T,FLOW_TYPE> _impl;
     
 }; // emd_hat_impl<long long int>
 //----------------------------------------------------------------------------------------
@@ -404,75 +449,116 @@ struct emd_hat_impl<double,FLOW_TYPE> {
         const std::vector< std::vector<NUM_T> >& C,
         NUM_T extra_mass_penalty,
         std::vector< std::vector<NUM_T> >* F) {
+        set_costs(C);
+        return solve(POrig,QOrig,P,Q,extra_mass_penalty,F);
+    }
+
+    // Converts the ground distance matrix, used by all the following calls to solve()
+    void set_costs(const std::vector< std::vector<NUM_T> >& C) {
+        
+    // Constructing the input
+    const NODE_T N= C.size();
+    _maxC= C[0][0];
+    for (NODE_T i= 0; i<N; ++i) {
+        for (NODE_T j= 0; j<N; ++j) {
+            if (C[i][j]>_maxC) _maxC= C[i][j];
+        }
+    }
+    _CnormFactor= MULT_FACTOR/_maxC;
+    _iC.resize(N);
+    for (NODE_T i= 0; i<N; ++i) {
+        _iC[i].resize(N);
+        for (NODE_T j= 0; j<N; ++j) {
+            _iC[i][j]= static_cast<CONVERT_TO_T>(floor(C[i][j]*_CnormFactor+0.5));
+        }
+    }
+    }
+
+    // Same as operator() with the ground distance matrix given to set_costs()
+    NUM_T solve(
+        const std::vector<NUM_T>& POrig, const std::vector<NUM_T>& QOrig,
+        const std::vector<NUM_T>& P, const std::vector<NUM_T>& Q,
+        NUM_T extra_mass_penalty,
+        std::vector< std::vector<NUM_T> >* F) {
         
     // TODO: static assert
     assert(sizeof(CONVERT_TO_T)>=8);
     
-    // This condition should hold:
-    // ( 2^(sizeof(CONVERT_TO_T*8)) >= ( MULT_FACTOR^2 )
-    // Note that it can be problematic to check it because
-    // of overflow problems. I simply checked it with Linux calc
-    // which has arbitrary precision.
-    const double MULT_FACTOR= 1000000; 
-
     // Constructing the input
     const NODE_T N= P.size();
-    std::vector<CONVERT_TO_T> iPOrig(N);
-    std::vector<CONVERT_TO_T> iQOrig(N);
-    std::vector<CONVERT_TO_T> iP(N);
-    std::vector<CONVERT_TO_T> iQ(N);
-    std::vector< std::vector<CONVERT_TO_T> > iC(N, std::vector<CONVERT_TO_T>(N) );
-    std::vector< std::vector<CONVERT_TO_T> > iF(N, std::vector<CONVERT_TO_T>(N) );
+    assert(_iC.size()==N);
+    _iPOrig.resize(N);
+    _iQOrig.resize(N);
+    _iP.resize(N);
+    _iQ.resize(N);
+    if (FLOW_TYPE!=NO_FLOW) {
+        _iF.resize(N);
+        for (NODE_T i= 0; i<N; ++i) _iF[i].resize(N);
+    }
 
     // Converting to CONVERT_TO_T
     double sumP= 0.0;
     double sumQ= 0.0;
-    double maxC= C[0][0];
     for (NODE_T i= 0; i<N; ++i) {
         sumP+= POrig[i];
         sumQ+= QOrig[i];
-        for (NODE_T j= 0; j<N; ++j) {
-            if (C[i][j]>maxC) maxC= C[i][j];
-        }
     }
     double minSum= std::min(sumP,sumQ);
     double maxSum= std::max(sumP,sumQ);
     double PQnormFactor= MULT_FACTOR/maxSum;
-    double CnormFactor= MULT_FACTOR/maxC;
     for (NODE_T i= 0; i<N; ++i) {
-        iPOrig[i]= static_cast<CONVERT_TO_T>(floor(POrig[i]*PQnormFactor+0.5));
-        iQOrig[i]= static_cast<CONVERT_TO_T>(floor(QOrig[i]*PQnormFactor+0.5));
-        iP[i]= static_cast<CONVERT_TO_T>(floor(P[i]*PQnormFactor+0.5));
-        iQ[i]= static_cast<CONVERT_TO_T>(floor(Q[i]*PQnormFactor+0.5));
-        for (NODE_T j= 0; j<N; ++j) {
-            iC[i][j]= static_cast<CONVERT_TO_T>(floor(C[i][j]*CnormFactor+0.5));
-            if (FLOW_TYPE!=NO_FLOW) {
-                iF[i][j]= static_cast<CONVERT_TO_T>(floor(((*F)[i][j])*PQnormFactor+0.5));
+        _iPOrig[i]= static_cast<CONVERT_TO_T>(floor(POrig[i]*PQnormFactor+0.5));
+        _iQOrig[i]= static_cast<CONVERT_TO_T>(floor(QOrig[i]*PQnormFactor+0.5));
+        _iP[i]= static_cast<CONVERT_TO_T>(floor(P[i]*PQnormFactor+0.5));
+        _iQ[i]= static_cast<CONVERT_TO_T>(floor(Q[i]*PQnormFactor+0.5));
+        if (FLOW_TYPE!=NO_FLOW) {
+            for (NODE_T j= 0; j<N; ++j) {
+                _iF[i][j]= static_cast<CONVERT_TO_T>(floor(((*F)[i][j])*PQnormFactor+0.5));
             }
         }
     }
 
     // computing distance without extra mass penalty
-    double dist= emd_hat_impl<CONVERT_TO_T,FLOW_TYPE>()(iPOrig,iQOrig,iP,iQ,iC,0,&iF);
+    double dist= _impl(_iPOrig,_iQOrig,_iP,_iQ,_iC,0,&_iF);
     // unnormalize
     dist= dist/PQnormFactor;
-    dist= dist/CnormFactor;
+    dist= dist/_CnormFactor;
     
     // adding extra mass penalty
-    if (extra_mass_penalty==-1) extra_mass_penalty= maxC;
+    if (extra_mass_penalty==-1) extra_mass_penalty= _maxC;
     dist+= (maxSum-minSum)*extra_mass_penalty;
         
     // converting flow to double
     if (FLOW_TYPE!=NO_FLOW) {
         for (NODE_T i= 0; i<N; ++i) {
             for (NODE_T j= 0; j<N; ++j) {
-                (*F)[i][j]= (iF[i][j]/PQnormFactor);
+                (*F)[i][j]= (_iF[i][j]/PQnormFactor);
             }
         }
     }
     
     return dist;
     }
+
+private:
+
+    // This condition should hold:
+    // ( 2^(sizeof(CONVERT_TO_T*8)) >= ( MULT_FACTOR^2 )
+    // Note that it can be problematic to check it because
+    // of overflow problems. I simply checked it with Linux calc
+    // which has arbitrary precision.
+    static constexpr double MULT_FACTOR= 1000000;
+
+    // Converted inputs, kept between calls
+    double _maxC;
+    double _CnormFactor;
+    std::vector<CONVERT_TO_T> _iPOrig;
+    std::vector<CONVERT_TO_T> _iQOrig;
+    std::vector<CONVERT_TO_T> _iP;
+    std::vector<CONVERT_TO_T> _iQ;
+    std::vector< std::vector<CONVERT_TO_T> > _iC;
+    std::vector< std::vector<CONVERT_TO_T> > _iF;
+    emd_hat_impl<CONVERT_TO_T,FLOW_TYPE> _impl;
     
 }; // emd_hat_impl<double>
 //----------------------------------------------------------------------------------------
@@ -3,7 +3,6 @@
 
 #include <vector>
 #include <limits>
-#include <list>
 #include <cassert>
 #include <math.h>
 #include "EMD_DEFS.hpp"
@@ -67,6 +66,14 @@ class min_cost_flow {
     NODE_T _num_nodes;
     std::vector<NODE_T> _nodes_to_Q;
 
+    // Buffers kept between calls, so that an instance solving many flows does not reallocate
+    std::vector< std::vector< edge1<NUM_T> > > _r_cost_forward;
+    std::vector< std::vector< edge2<NUM_T> > > _r_cost_cap_backward;
+    std::vector< NUM_T > _d;
+    std::vector< NODE_T > _prev;
+    std::vector< edge3<NUM_T> > _Q;
+    std::vector< NODE_T > _final_nodes_flg;
+
     //tictoc tictoc_shortest_path;
     //tictoc tictoc_while_true;
     //tictoc tmp_tic_toc;
@@ -78,8 +85,8 @@ public:
     // c[i] - edges that goes from node i. first is the second nod
     // x - the flow is returned in it
     NUM_T operator()(std::vector<NUM_T>& e,
-                     const std::vector< std::list< edge<NUM_T> > >& c,
-                     std::vector< std::list<  edge0<NUM_T>  > >& x) {
+                     const std::vector< std::vector< edge<NUM_T> > >& c,
+                     std::vector< std::vector<  edge0<NUM_T>  > >& x) {
 
         //for (NODE_T i=0; i<e.size(); ++i) cout << e[i]<< " ";
         //cout << endl;
@@ -93,7 +100,7 @@ public:
         
         // init flow
         {for (NODE_T from=0; from<_num_nodes; ++from) {
-            {for (typename std::list< edge<NUM_T> >::const_iterator it= c[from].begin(); it!=c[from].end(); ++it) {
+            {for (typename std::vector< edge<NUM_T> >::const_iterator it= c[from].begin(); it!=c[from].end(); ++it) {
                 x[from].push_back(  edge0<NUM_T> (it->_to, it->_cost, 0) );
                 x[it->_to].push_back(  edge0<NUM_T> (from, -it->_cost,0) );
             }} // it
@@ -101,18 +108,22 @@ public:
         
         // reduced costs for forward edges (c[i,j]-pi[i]+pi[j])
         // Note that for forward edges the residual capacity is infinity
-        std::vector< std::list< edge1<NUM_T> > > r_cost_forward(_num_nodes);
+        std::vector< std::vector< edge1<NUM_T> > >& r_cost_forward= _r_cost_forward;
+        r_cost_forward.resize(_num_nodes);
+        {for (NODE_T from=0; from<_num_nodes; ++from) r_cost_forward[from].clear();}
         {for (NODE_T from=0; from<_num_nodes; ++from) {
-            {for (typename std::list<  edge<NUM_T>  >::const_iterator it= c[from].begin(); it!=c[from].end(); ++it) {
+            {for (typename std::vector<  edge<NUM_T>  >::const_iterator it= c[from].begin(); it!=c[from].end(); ++it) {
                     r_cost_forward[from].push_back( edge1<NUM_T>(it->_to,it->_cost) );
             }}
         }}
         
         // reduced costs and capacity for backward edges (c[j,i]-pi[j]+pi[i])
         // Since the flow at the beginning is 0, the residual capacity is also zero
-        std::vector< std::list< edge2<NUM_T> > > r_cost_cap_backward(_num_nodes);
+        std::vector< std::vector< edge2<NUM_T> > >& r_cost_cap_backward= _r_cost_cap_backward;
+        r_cost_cap_backward.resize(_num_nodes);
+        {for (NODE_T from=0; from<_num_nodes; ++from) r_cost_cap_backward[from].clear();}
         {for (NODE_T from=0; from<_num_nodes; ++from) {
-            {for (typename std::list<  edge<NUM_T>  >::const_iterator it= c[from].begin(); it!=c[from].end(); ++it) {
+            {for (typename std::vector<  edge<NUM_T>  >::const_iterator it= c[from].begin(); it!=c[from].end(); ++it) {
                     r_cost_cap_backward[ it->_to ].push_back( edge2<NUM_T>(from,-it->_cost,0) );
             }} // it
         }} // from
@@ -126,8 +137,10 @@ public:
 
         
 
-        std::vector< NUM_T > d(_num_nodes);
-        std::vector< NODE_T > prev(_num_nodes);
+        std::vector< NUM_T >& d= _d;
+        std::vector< NODE_T >& prev= _prev;
+        d.resize(_num_nodes);
+        prev.resize(_num_nodes);
         delta= 1;
         //while (delta>=1) {
         
@@ -167,7 +180,7 @@ public:
                     assert(from!=to);
                                         
                     // residual
-                    typename std::list< edge2<NUM_T> >::iterator itccb= r_cost_cap_backward[from].begin();
+                    typename std::vector< edge2<NUM_T> >::iterator itccb= r_cost_cap_backward[from].begin();
                     while ( (itccb!=r_cost_cap_backward[from].end()) && (itccb->_to!=to) ) {
                         ++itccb;
                     }
@@ -187,14 +200,14 @@ public:
                     assert(from!=to);
                                         
                     // TODO - might do here O(n) can be done in O(1)
-                    typename std::list<  edge0<NUM_T>  >::iterator itx= x[from].begin();
+                    typename std::vector<  edge0<NUM_T>  >::iterator itx= x[from].begin();
                     while (itx->_to!=to) {
                         ++itx;
                     }
                     itx->_flow+= delta;
                                         
                     // update residual for backward edges
-                    typename std::list< edge2<NUM_T> >::iterator itccb= r_cost_cap_backward[to].begin();
+                    typename std::vector< edge2<NUM_T> >::iterator itccb= r_cost_cap_backward[to].begin();
                     while ( (itccb!=r_cost_cap_backward[to].end()) && (itccb->_to!=from) ) {
                         ++itccb;
                     }
@@ -231,7 +244,7 @@ public:
             //cout << endl << endl;
             NUM_T dist= 0;
             {for (NODE_T from=0; from<_num_nodes; ++from) {
-                {for (typename std::list<  edge0<NUM_T>  >::const_iterator it= x[from].begin(); it!=x[from].end(); ++it) {
+                {for (typename std::vector<  edge0<NUM_T>  >::const_iterator it= x[from].begin(); it!=x[from].end(); ++it) {
 //                        if (it->_flow!=0) cout << from << "->" << it->_to << ": " << it->_flow << "x" << it->_cost << endl;
                         dist+= (it->_cost*it->_flow);
                 }} // it
@@ -262,8 +275,8 @@ private:
                                std::vector< NODE_T >& prev,
                                
                                NODE_T from,
-                               std::vector< std::list< edge1<NUM_T> > >& cost_forward,
-                               std::vector< std::list< edge2<NUM_T> > >& cost_backward,
+                               std::vector< std::vector< edge1<NUM_T> > >& cost_forward,
+                               std::vector< std::vector< edge2<NUM_T> > >& cost_backward,
 
                                const std::vector<NUM_T>& e,
                                NODE_T& l) {
@@ -272,7 +285,8 @@ private:
         //----------------------------------------------------------------
         // Making heap (all inf except 0, so we are saving comparisons...)
         //----------------------------------------------------------------
-        std::vector<  edge3<NUM_T>  > Q(_num_nodes);
+        std::vector<  edge3<NUM_T>  >& Q= _Q;
+        Q.resize(_num_nodes);
         
         Q[0]._to= from;
         _nodes_to_Q[from]= 0;
@@ -299,7 +313,8 @@ private:
         //----------------------------------------------------------------
         // main loop
         //----------------------------------------------------------------
-        std::vector<NODE_T> finalNodesFlg(_num_nodes, false);
+        std::vector<NODE_T>& finalNodesFlg= _final_nodes_flg;
+        finalNodesFlg.assign(_num_nodes, false);
         do {
             NODE_T u= Q[0]._to;
                         
@@ -314,7 +329,7 @@ private:
             
             
             // neighbors of u    
-            {for (typename std::list< edge1<NUM_T> >::const_iterator it= cost_forward[u].begin(); it!=cost_forward[u].end(); ++it) {
+            {for (typename std::vector< edge1<NUM_T> >::const_iterator it= cost_forward[u].begin(); it!=cost_forward[u].end(); ++it) {
                 assert (it->_reduced_cost>=0);
                 NUM_T alt= d[u]+it->_reduced_cost;
                 NODE_T v= it->_to;
@@ -324,7 +339,7 @@ private:
                     prev[v]= u;
                 }
             }} //it
-            {for (typename std::list< edge2<NUM_T> >::const_iterator it= cost_backward[u].begin(); it!=cost_backward[u].end(); ++it) {
+            {for (typename std::vector< edge2<NUM_T> >::const_iterator it= cost_backward[u].begin(); it!=cost_backward[u].end(); ++it) {
                 if (it->_residual_capacity>0) {
                     assert (it->_reduced_cost>=0);
                     NUM_T alt= d[u]+it->_reduced_cost;
@@ -344,7 +359,7 @@ private:
         //---------------------------------------------------------------------------------
         // reduced costs for forward edges (c[i,j]-pi[i]+pi[j])
 								   {for (NODE_T from=0; from<_num_nodes; ++from) {
-                                           {for (typename std::list< edge1<NUM_T> >::iterator it= cost_forward[from].begin();
+                                           {for (typename std::vector< edge1<NUM_T> >::iterator it= cost_forward[from].begin();
                  it!=cost_forward[from].end(); ++it) {
                 if (finalNodesFlg[from]) {
                     it->_reduced_cost+= d[from] - d[l];
@@ -357,7 +372,7 @@ private:
         
         // reduced costs and capacity for backward edges (c[j,i]-pi[j]+pi[i])
 								   {for (NODE_T from=0; from<_num_nodes; ++from) {
-                                           {  for (typename std::list< edge2<NUM_T> >::iterator it= cost_backward[from].begin();
+                                           {  for (typename std::vector< edge2<NUM_T> >::iterator it= cost_backward[from].begin();
                  it!=cost_backward[from].end(); ++it) {
                 if (finalNodesFlg[from]) {
                     it->_reduced_cost+= d[from] - d[l];
@@ -5,11 +5,14 @@
 #include <unsupported/Eigen/CXX11/Tensor>
 
 #include <vector>
+#include <cstring>
+#include <type_traits>
 
 //Other
 #include "typedefs.h"
 #include <boost/filesystem.hpp>
 #include "emd_hat.hpp"
+#include "CellKernels.h"
 #include <math.h>
 
 
@@ -21,6 +24,154 @@
 
 typedef float Scalar;
 
+template <typename Type> class Tensor3D;
+
+/// Non-owning view of a block of a Tensor3D, the cells stay where they are in the memory of the
+/// tensor (a run of cells along x is contiguous, the rows and slices are strided).
+/// A view over const cells (Tensor3DView<const Cell>) is read only, one over mutable cells can be
+/// written through. The tensor must outlive the view.
+template <typename Type>
+class Tensor3DView{
+public:
+    typedef typename std::remove_const<Type>::type Value;
+
+    static const int CellScalars = sizeof(Value) / sizeof(Scalar);
+
+    Tensor3DView() : data_(0), depths_(0), rows_(0), cols_(0), rowStride_(0), sliceStride_(0)
+    {}
+
+    /// Constructs a view of size (depths, rows, cols) starting at @p data, inside a tensor whose
+    /// rows hold @p rowStride cells and slices @p sliceStride cells.
+    Tensor3DView( Type* data, int depths, int rows, int cols, int rowStride, int sliceStride)
+        : data_(data), depths_(depths), rows_(rows), cols_(cols), rowStride_(rowStride),
+          sliceStride_(sliceStride)
+    {}
+
+    /// Read only view of a mutable one.
+    operator Tensor3DView<const Value>() const{
+        return Tensor3DView<const Value>( data_, depths_, rows_, cols_, rowStride_, sliceStride_);
+    }
+
+    int depths() const{
+        return depths_;
+    }
+    int rows() const{
+        return rows_;
+    }
+    int cols() const{
+        return cols_;
+    }
+    int size() const{
+        return depths_ * rows_ * cols_;
+    }
+
+    Type& operator()( int z, int y, int x) const{
+        return data_[z * sliceStride_ + y * rowStride_ + x];
+    }
+
+    /// First cell of the (contiguous) row (z, y).
+    Type* row( int z, int y) const{
+        return data_ + z * sliceStride_ + y * rowStride_;
+    }
+
+    //Level
+    Scalar dot( const Tensor3D< Value>& filter) const{
+        return dot( filter.view());
+    }
+
+    //Level
+    Scalar dot( const Tensor3DView<const Value>& filter) const{
+        Scalar res = 0;
+        for (int z = 0; z < depths_; ++z) {
+            for (int y = 0; y < rows_; ++y) {
+                res += FFLD::CellKernels::Dot(reinterpret_cast<const Scalar*>(row(z, y)),
+                                              reinterpret_cast<const Scalar*>(filter.row(z, y)),
+                                              cols_ * CellScalars);
+            }
+        }
+        return res;
+    }
+
+    Value sum() const{
+        Value res = 0;
+        for (int z = 0; z < depths_; ++z) {
+            for (int y = 0; y < rows_; ++y) {
+                const Type* cells = row(z, y);
+                for (int x = 0; x < cols_; ++x) {
+                    res += cells[x];
+                }
+            }
+        }
+        return res;
+    }
+
+    Value squaredNorm() const{
+        Value res = 0;
+        for (int z = 0; z < depths_; ++z) {
+            for (int y = 0; y < rows_; ++y) {
+                const Type* cells = row(z, y);
+                for (int x = 0; x < cols_; ++x) {
+                    res += cells[x] * cells[x];
+                }
+            }
+        }
+        return res;
+    }
+
+    //Level
+    Scalar lvlSquaredNorm() const{
+        return sqrt(dot( *this));
+    }
+
+    void setZero() const{
+        for (int z = 0; z < depths_; ++z) {
+            for (int y = 0; y < rows_; ++y) {
+                std::memset( row(z, y), 0, cols_ * sizeof(Value));
+            }
+        }
+    }
+
+    //Level
+    // Mean cell of the block
+    Tensor3D< Value> agglomerate() const{
+        Tensor3D< Value> res(1,1,1);
+        res().setConstant( Value::Zero());
+        Scalar* mean = res().data()->data();
+
+        for (int z = 0; z < depths_; ++z) {
+            for (int y = 0; y < rows_; ++y) {
+                const Scalar* cells = reinterpret_cast<const Scalar*>(row(z, y));
+                for (int x = 0; x < cols_; ++x) {
+                    FFLD::CellKernels::Axpy(1, cells + x * CellScalars, mean, CellScalars);
+                }
+            }
+        }
+        if( size()){
+            FFLD::CellKernels::Scale(Scalar(1) / size(), mean, CellScalars);
+        }
+        return res;
+    }
+
+    /// Copies the block into a tensor of its own, for when it has to outlive the viewed tensor.
+    Tensor3D< Value> copy() const{
+        Tensor3D< Value> res( depths_, rows_, cols_);
+        for (int z = 0; z < depths_; ++z) {
+            for (int y = 0; y < rows_; ++y) {
+                std::copy( row(z, y), row(z, y) + cols_, &res()(z, y, 0));
+            }
+        }
+        return res;
+    }
+
+private:
+    Type* data_;
+    int depths_;
+    int rows_;
+    int cols_;
+    int rowStride_;
+    int sliceStride_;
+};
+
 template <typename Type>
 class Tensor3D{
 public:
@@ -62,6 +213,19 @@ public:
         return tensor.size();//rows() * cols() * depths();
     }
 
+    //Level
+    // Number of scalars per cell, the cells are stored contiguously so a whole tensor (or a run of
+    // consecutive cells along x) can be handed to the CellKernels at once
+    static const int CellScalars = sizeof(Type) / sizeof(Scalar);
+
+    const Scalar* scalars() const{
+        return reinterpret_cast<const Scalar*>(tensor.data());
+    }
+
+    Scalar* scalars(){
+        return reinterpret_cast<Scalar*>(tensor.data());
+    }
+
     bool isZero() const{
         for (int i = 0; i < depths(); ++i) {
             for (int j = 0; j < rows(); ++j) {
@@ -103,192 +267,157 @@ public:
 
 
     //Level
-    Tensor3D<Scalar> RBFconvolve( Tensor3D< Type> filter) const{
-//        cout<<"tensor3D::convolve ..."<<endl;
+    // Squared norm of each cell
+    Tensor3D<Scalar> cellSquaredNorms() const{
+        Tensor3D<Scalar> res( depths(), rows(), cols());
+        const Scalar* cells = scalars();
 
-        Tensor3D<Scalar> res( depths() - filter.depths() + 1,
-                              rows() - filter.rows() + 1,
-                              cols() - filter.cols() + 1);
+#pragma omp parallel for
+        for (int i = 0; i < size(); ++i) {
+            res().data()[i] = FFLD::CellKernels::Dot(cells + i * CellScalars, cells + i * CellScalars,
+                                                     CellScalars);
+        }
+        return res;
+    }
 
+    //Level
+    Tensor3D<Scalar> RBFconvolve( const Tensor3D< Type>& filter) const{
+        return RBFconvolve( filter, cellSquaredNorms());
+    }
 
+    //Level
+    /// Sum over the filter cells of exp(-gamma * ||a - b||^2), with the distance expanded as
+    /// ||a||^2 + ||b||^2 - 2 a.b so that all the dot products are a single matrix product.
+    /// @param[in] squaredNorms Squared norms of the cells of this tensor (see cellSquaredNorms()).
+    Tensor3D<Scalar> RBFconvolve( const Tensor3D< Type>& filter, const Tensor3D<Scalar>& squaredNorms,
+                                  Scalar gamma = 10) const{
+        typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Matrix;
+
+        if( depths() < filter.depths() || rows() < filter.rows() || cols() < filter.cols()){
+            return Tensor3D<Scalar>();
+        }
 
-        res().setConstant( 0);
+        Tensor3D<Scalar> res( depths() - filter.depths() + 1,
+                              rows() - filter.rows() + 1,
+                              cols() - filter.cols() + 1);
 
-//        Scalar filterNorm = filter.lvlSquaredNorm();
+        const int nbFilterCells = filter.size();
+        const Eigen::Map<const Matrix> cells( scalars(), size(), CellScalars);
+        const Eigen::Map<const Matrix> filterCells( filter.scalars(), nbFilterCells, CellScalars);
 
-// Uncomment if you want to normalize the convolution score
-//        Type filterMean = filter.sum() / Scalar(filter.size());
+        // Dot product of every cell with every filter cell ([cell][filter cell])
+        const Matrix dots = cells * filterCells.transpose();
+        const Eigen::VectorXf filterNorms = filterCells.rowwise().squaredNorm();
 
-#pragma omp parallel for //num_threads(omp_get_max_threads())
-        for (int z = 0; z < res.depths(); ++z) {
 #pragma omp parallel for
+        for (int z = 0; z < res.depths(); ++z) {
+            // The distances of a whole slice go through a single vectorized exp
+            Matrix distances( res.rows() * res.cols(), nbFilterCells);
+
             for (int y = 0; y < res.rows(); ++y) {
-#pragma omp parallel for
                 for (int x = 0; x < res.cols(); ++x) {
-
-//                    Type tensorMean = agglomerateBlock(z, y, x, filter.depths(), filter.rows(), filter.cols())()(0,0,0) /
-//                            Scalar(filter.size());
-
-                    Scalar tensorNorm = block(z,y,x,filter.depths(), filter.rows(), filter.cols()).lvlSquaredNorm();
-                    if(!tensorNorm) tensorNorm = 1;
-
-//                    Type squaredNormTensor;
-//                    Type squaredNormFilter;
-//                    squaredNormTensor.setConstant( 0);
-//                    squaredNormFilter.setConstant( 0);
-//                    Scalar aux( 0);
-
+                    int k = 0;
                     for (int dz = 0; dz < filter.depths(); ++dz) {
                         for (int dy = 0; dy < filter.rows(); ++dy) {
-                            for (int dx = 0; dx < filter.cols(); ++dx) {
-
-                                Type normTensor = tensor(z+dz, y+dy, x+dx) /*- tensorMean*/;
-                                Type normFilter = filter()(dz, dy, dx) /*- filterMean*/;
-
-//                                Type sum = filter.sum();
-//                                for(int i=0; i<352; ++i){
-//                                    if (sum(i) !=0) normFi/*- tensorMean*/lter(i) /= sum(i);
-//                                    else normFilter(i) = 0;
-//                                }
-//                                squaredNormTensor += normTensor * normTensor;
-//                                squaredNormFilter += normFilter * normFilter;
-//                                aux += normTensor.matrix().dot(normFilter.matrix()) * normTensor.matrix().dot(normFilter.matrix());
-                                Type diff = normTensor - normFilter;
-                                Scalar norm = 0;
-                                for(int i=0; i<352; ++i){
-                                    norm += diff(i) * diff(i);
-                                }
-                                float gamma = 10;
-
-                                res()(z, y, x) += exp(-gamma * norm);
-
+                            for (int dx = 0; dx < filter.cols(); ++dx, ++k) {
+                                const int cell = ((z + dz) * rows() + y + dy) * cols() + x + dx;
+                                distances(y * res.cols() + x, k) = squaredNorms().data()[cell] +
+                                        filterNorms(k) - 2 * dots(cell, k);
                             }
                         }
                     }
-//                    res()(z, y, x) /= (filterNorm /** tensorNorm*/);
-//                    res()(z, y, x) /= sqrt(squaredNormTensor.matrix().sum() * squaredNormFilter.matrix().sum());
                 }
             }
+
+            // Rounding can leave tiny negative distances
+            const int sliceSize = res.rows() * res.cols();
+            Eigen::Map<Eigen::VectorXf>( res().data() + z * sliceSize, sliceSize) =
+                    (-gamma * distances.array().max(0)).exp().rowwise().sum();
         }
         return res;
     }
 
 
     //Level
-    Tensor3D<Scalar> convolve( Tensor3D< Type> filter) const{
-//        cout<<"tensor3D::convolve ..."<<endl;
-
+    /// You should change the sign of the maxScore variable in Mixture::PosLatenSearch()
+    /// if you use this function.
+    Tensor3D<Scalar> khi2Convolve( const Tensor3D< Type>& filter) const{
         Tensor3D<Scalar> res( depths() - filter.depths() + 1,
                               rows() - filter.rows() + 1,
                               cols() - filter.cols() + 1);
 
-
-
         res().setConstant( 0);
 
-        Scalar filterNorm = filter.lvlSquaredNorm();
-
-// Uncomment if you want to normalize the convolution score
-//        Type filterMean = filter.sum() / Scalar(filter.size());
-
-        #pragma omp parallel for //num_threads(omp_get_max_threads())
+        // The chi-square kernel masks the null denominators instead of branching on them
+#pragma omp parallel for
         for (int z = 0; z < res.depths(); ++z) {
-            #pragma omp parallel for
             for (int y = 0; y < res.rows(); ++y) {
-                #pragma omp parallel for
                 for (int x = 0; x < res.cols(); ++x) {
 
-//                    Type tensorMean = agglomerateBlock(z, y, x, filter.depths(), filter.rows(), filter.cols())()(0,0,0) /
-//                            Scalar(filter.size());
-
-                    Scalar tensorNorm = block(z,y,x,filter.depths(), filter.rows(), filter.cols()).lvlSquaredNorm();
-                    if(!tensorNorm) tensorNorm = 1;
-
-//                    Type squaredNormTensor;
-//                    Type squaredNormFilter;
-//                    squaredNormTensor.setConstant( 0);
-//                    squaredNormFilter.setConstant( 0);
-//                    Scalar aux( 0);
 
                     for (int dz = 0; dz < filter.depths(); ++dz) {
                         for (int dy = 0; dy < filter.rows(); ++dy) {
-                            for (int dx = 0; dx < filter.cols(); ++dx) {
-
-                                Type normTensor = tensor(z+dz, y+dy, x+dx) /*- tensorMean*/;
-                                Type normFilter = filter()(dz, dy, dx) /*- filterMean*/;
-
-//                                Type sum = filter.sum();
-//                                for(int i=0; i<352; ++i){
-//                                    if (sum(i) !=0) normFi/*- tensorMean*/lter(i) /= sum(i);
-//                                    else normFilter(i) = 0;
-//                                }
-//                                squaredNormTensor += normTensor * normTensor;
-//                                squaredNormFilter += normFilter * normFilter;
-//                                aux += normTensor.matrix().dot(normFilter.matrix()) * normTensor.matrix().dot(normFilter.matrix());
-                                res()(z, y, x) += normTensor.matrix().dot(normFilter.matrix());
-
-                            }
+                            res()(z, y, x) += FFLD::CellKernels::ChiSquare(filter()(dz, dy, 0).data(),
+                                                                           tensor(z+dz, y+dy, x).data(),
+                                                                           filter.cols() * CellScalars);
                         }
                     }
-//                    res()(z, y, x) /= (filterNorm * tensorNorm);
-//                    res()(z, y, x) /= sqrt(squaredNormTensor.matrix().sum() * squaredNormFilter.matrix().sum());
+
                 }
             }
         }
         return res;
     }
 
+
     //Level
-    /// You should change the sign of the maxScore variable in Mixture::PosLatenSearch()
-    /// if you use this function.
-    Tensor3D<Scalar> khi2Convolve( Tensor3D< Type> filter) const{
+    /// Sum over the filter cells and the SHOT sub-histograms (of 11 bins) of the EMD-hat for the
+    /// thresholded ground distance min(|i - j|, 3), computed in closed form on the cumulative sums
+    /// (see CellKernels::ThresholdedEMD).
+    Tensor3D<Scalar> EMD( const Tensor3D< Type>& filter) const{
+        const int nbBins = 11;
+        const Scalar threshold = 3;
+
         Tensor3D<Scalar> res( depths() - filter.depths() + 1,
                               rows() - filter.rows() + 1,
                               cols() - filter.cols() + 1);
 
         res().setConstant( 0);
 
-//#pragma omp parallel for num_threads(omp_get_max_threads())
+#pragma omp parallel for
         for (int z = 0; z < res.depths(); ++z) {
             for (int y = 0; y < res.rows(); ++y) {
                 for (int x = 0; x < res.cols(); ++x) {
-
-
                     for (int dz = 0; dz < filter.depths(); ++dz) {
                         for (int dy = 0; dy < filter.rows(); ++dy) {
                             for (int dx = 0; dx < filter.cols(); ++dx) {
+                                const Scalar* cell = tensor(z+dz, y+dy, x+dx).data();
+                                const Scalar* filterCell = filter()(dz, dy, dx).data();
 
-//                                Type candidate = tensor(z+dz, y+dy, x+dx);
-//                                for (int j = 0; j < 352; ++j) {
-//                                    Scalar denominator = (abs(filter()(dz, dy, dx)(j)) + abs(candidate(j)));
-//                                    if( denominator != 0){
-//                                        res()(z, y, x) += (filter()(dz, dy, dx)(j) - candidate(j)) * (filter()(dz, dy, dx)(j) - candidate(j))
-//                                                / denominator;
-//                                    }
-//                                }
-
-                                Type candidate = tensor(z+dz, y+dy, x+dx);
-                                Type numerator = (filter()(dz, dy, dx) - candidate) * (filter()(dz, dy, dx) - candidate);
-                                Type denominator = abs(filter()(dz, dy, dx)) + abs(candidate);
-                                for (int j = 0; j < 352; ++j) {
-                                    if( denominator(j) != 0){
-                                        res()(z, y, x) += numerator(j) / denominator(j);
-                                    }
+                                for (int i = 0; i + nbBins <= CellScalars; i += nbBins) {
+                                    res()(z, y, x) += FFLD::CellKernels::ThresholdedEMD(cell + i, filterCell + i,
+                                                                                       nbBins, threshold,
+                                                                                       threshold);
                                 }
-
                             }
                         }
                     }
-
                 }
             }
         }
         return res;
     }
 
-
     //Level
-    Tensor3D<Scalar> EMD( Tensor3D< Type> filter) const{
+    /// Same as EMD() for an arbitrary ground distance, with the general min cost flow solver.
+    /// @param[in] costs Ground distance between the bins of each block of costs.size() bins of
+    /// the cells (352 to compare whole descriptors), only read so it can be shared by all the
+    /// threads.
+    /// @param[in] extraMassPenalty Cost of a unit of mass that is not transported (-1 for the
+    /// maximum ground distance).
+    Tensor3D<Scalar> EMD( const Tensor3D< Type>& filter, const std::vector<std::vector<double> >& costs,
+                          double extraMassPenalty = -1) const{
+        const int nbBins = costs.size();
 
         Tensor3D<Scalar> res( depths() - filter.depths() + 1,
                               rows() - filter.rows() + 1,
@@ -296,37 +425,34 @@ public:
 
         res().setConstant( 0);
 
-        // Ground metric definition (certainly highly optimizable)
-        vector<double> desc_filter(352);
-
-        std::vector<std::vector<double> > cost_mat;
-        int ground_metric_threshold = 3;
-        std::vector<double> cost_mat_row(352);
-        for (unsigned int i=0; i<352; ++i){
-            desc_filter[i] = filter()(0,0,0)(i);
-            cost_mat.push_back(cost_mat_row);
+        if( !nbBins || nbBins > CellScalars){
+            return res;
         }
 
-        #pragma omp parallel for
-        for (int z = 0; z < res.depths(); ++z) {
-            #pragma omp parallel for
-            for (int y = 0; y < res.rows(); ++y) {
-                #pragma omp parallel for
-                for (int x = 0; x < res.cols(); ++x) {
-
-                    vector<double> desc_lvl(352);
-
-                    // Naive ground metric
-                    for (int i=0; i<352; ++i){
-                        desc_lvl[i] = tensor(z, y, x)(i);
-                        for (int j=0; j<352; ++j){
-                            cost_mat[i][j]= std::min( ground_metric_threshold, abs(i-j));
+#pragma omp parallel
+        {
+            // One solver per thread, reused for all its positions
+            emd_hat_gd_metric_solver solver;
+            solver.set_costs( costs);
+            vector<double> distances( CellScalars / nbBins);
+
+#pragma omp for
+            for (int z = 0; z < res.depths(); ++z) {
+                for (int y = 0; y < res.rows(); ++y) {
+                    for (int x = 0; x < res.cols(); ++x) {
+                        for (int dz = 0; dz < filter.depths(); ++dz) {
+                            for (int dy = 0; dy < filter.rows(); ++dy) {
+                                for (int dx = 0; dx < filter.cols(); ++dx) {
+                                    solver( tensor(z+dz, y+dy, x+dx).data(), filter()(dz, dy, dx).data(),
+                                            distances.size(), distances.data(), extraMassPenalty);
+
+                                    for (int i = 0; i < distances.size(); ++i) {
+                                        res()(z, y, x) += distances[i];
+                                    }
+                                }
+                            }
                         }
                     }
-
-                    res()(z, y, x) = emd_hat_gd_metric<double>()(desc_lvl, desc_filter, cost_mat,
-                                                                 ground_metric_threshold);
-
                 }
             }
         }
@@ -340,99 +466,65 @@ public:
         if(z+p>depths() || y+q>rows() || x+r>cols() || z < 0 || y < 0 || x < 0){
             cerr<<"agglomerateBlock:: Try to access : "<<z+p<<" / "<<y+q<<" / "<<x+r<<" on matrix size : "
                <<depths()<<" / "<<rows()<<" / "<<cols()<<endl;
-            p = std::min(z+p, depths()) - z;
-            q = std::min(y+q, rows()) - y;
-            r = std::min(x+r, cols()) - x;
-        }
-        Tensor3D< Type> res(1,1,1);
-        res().setConstant( Type::Zero());
-//#pragma omp parallel for num_threads(omp_get_max_threads())
-        for (int i = z; i < p; ++i) {
-            for (int j = y; j < q; ++j) {
-                for (int k = x; k < r; ++k) {
-                    res()(0,0,0) += tensor(i, j, k);
-                }
-            }
+            z = std::max(z, 0);
+            y = std::max(y, 0);
+            x = std::max(x, 0);
+            p = std::max(std::min(z+p, depths()) - z, 0);
+            q = std::max(std::min(y+q, rows()) - y, 0);
+            r = std::max(std::min(x+r, cols()) - x, 0);
         }
-        for(int j = 0; j < 352; ++j) res()(0,0,0)(j) /= p*q*r;
-        return res;
+        return blockView(z, y, x, p, q, r).agglomerate();
     }
 
 
     //Level
     Tensor3D< Type> agglomerate() const{
-        Tensor3D< Type> res(1,1,1);
-        res().setConstant( Type::Zero());
-//#pragma omp parallel for num_threads(omp_get_max_threads())
-        for (int z = 0; z < depths(); ++z) {
-            for (int y = 0; y < rows(); ++y) {
-                for (int x = 0; x < cols(); ++x) {
-                    res()(0,0,0) += tensor(z, y, x);
-                }
-            }
-        }
-        for(int j = 0; j < 352; ++j) res()(0,0,0)(j) /= depths()*rows()*cols();
-        return res;
+        return view().agglomerate();
     }
 
     //Level
     Scalar dot( const Tensor3D< Type>& sample) const{
-        Scalar res = 0;
-//#pragma omp parallel for num_threads(omp_get_max_threads())
-        for (int z = 0; z < depths(); ++z) {
-            for (int y = 0; y < rows(); ++y) {
-                for (int x = 0; x < cols(); ++x) {
-                    for (int j = 0; j < 352; ++j) {
-                        res += tensor(z, y, x)(j) * sample()(z, y, x)(j);
-                    }
-                }
-            }
+        return FFLD::CellKernels::Dot(scalars(), sample.scalars(), size() * CellScalars);
+    }
+
+    bool hasSameSize( const Tensor3D< Type>& t) const{
+        return depths() == t.depths() && rows() == t.rows() && cols() == t.cols();
+    }
+
+    //Level
+    // In-place this += alpha * t, without any temporary. Returns false and leaves the tensor
+    // unchanged if the sizes differ.
+    bool axpy( Scalar alpha, const Tensor3D< Type>& t){
+        if( !hasSameSize( t)){
+            return false;
         }
-        return res;
+        FFLD::CellKernels::Axpy(alpha, t.scalars(), scalars(), size() * CellScalars);
+        return true;
+    }
+
+    //Level
+    // In-place this *= alpha
+    void scale( Scalar alpha){
+        FFLD::CellKernels::Scale(alpha, scalars(), size() * CellScalars);
     }
 
     //Level
     void operator*=( const Scalar& coef){
-//#pragma omp parallel for
-        for (int z = 0; z < depths(); ++z) {
-            for (int y = 0; y < rows(); ++y) {
-                for (int x = 0; x < cols(); ++x) {
-                    (*this)()(z, y, x) *= coef;
-                }
-            }
-        }
+        scale( coef);
     }
 
     //Level
+    // Allocates the result, prefer scale() or axpy() in loops
     Tensor3D< Type> operator*( const Scalar& coef) const{
-        Tensor3D< Type> res = *this;
-//#pragma omp parallel for num_threads(omp_get_max_threads())
-        for (int z = 0; z < depths(); ++z) {
-            for (int y = 0; y < rows(); ++y) {
-                for (int x = 0; x < cols(); ++x) {
-                    for (int j = 0; j < 352; ++j) {
-                        res()(z, y, x)(j) *= coef;
-                    }
-                }
-            }
-        }
+        Tensor3D< Type> res( depths(), rows(), cols());
+        Eigen::Map<Eigen::ArrayXf>( res.scalars(), size() * CellScalars) =
+                coef * Eigen::Map<const Eigen::ArrayXf>( scalars(), size() * CellScalars);
         return res;
     }
 
     //Level
     void operator+=( const Tensor3D< Type>& t){
-        #pragma omp parallel for /*num_threads(omp_get_max_threads())*/
-        for (int z = 0; z < depths(); ++z) {
-            #pragma omp parallel for
-            for (int y = 0; y < rows(); ++y) {
-                #pragma omp parallel for
-                for (int x = 0; x < cols(); ++x) {
-                    for (int j = 0; j < 352; ++j) {
-                        tensor(z, y, x)(j) += t()(z, y, x)(j);
-                    }
-                }
-            }
-        }
+        axpy( 1, t);
     }
 
 
@@ -461,24 +553,40 @@ public:
 
 
 
-    //TODO replace by TensorMap
-    //return a block of size (p, q, r) from point (z, y, x)
+    //return a copy of the block of size (p, q, r) from point (z, y, x), see blockView() to avoid
+    //the copy
     Tensor3D< Type> block(int z, int y, int x, int p, int q, int r) const{
+        return blockView(z, y, x, p, q, r).copy();
+    }
+
+    //return a view of the block of size (p, q, r) from point (z, y, x), without copying it
+    Tensor3DView< const Type> blockView(int z, int y, int x, int p, int q, int r) const{
         if(z+p>depths() || y+q>rows() || x+r>cols() || z < 0 || y < 0 || x < 0){
-            cerr<<"block:: Try to access : "<<z+p<<" / "<<y+q<<" / "<<x+r<<" on matrix size : "
+            cerr<<"blockView:: Try to access : "<<z+p<<" / "<<y+q<<" / "<<x+r<<" on matrix size : "
                <<depths()<<" / "<<rows()<<" / "<<cols()<<endl;
             exit(0);
         }
-        Tensor3D< Type> t(p, q, r);
-//#pragma omp parallel for
-        for (int i = 0; i < p; ++i) {
-            for (int j = 0; j < q; ++j) {
-                for (int k = 0; k < r; ++k) {
-                    t()(i,j,k) = tensor(z+i, y+j, x+k);
-                }
-            }
+        return Tensor3DView< const Type>(tensor.data() + (z * rows() + y) * cols() + x, p, q, r,
+                                         cols(), rows() * cols());
+    }
+
+    //return a mutable view of the block of size (p, q, r) from point (z, y, x)
+    Tensor3DView< Type> blockView(int z, int y, int x, int p, int q, int r){
+        if(z+p>depths() || y+q>rows() || x+r>cols() || z < 0 || y < 0 || x < 0){
+            cerr<<"blockView:: Try to access : "<<z+p<<" / "<<y+q<<" / "<<x+r<<" on matrix size : "
+               <<depths()<<" / "<<rows()<<" / "<<cols()<<endl;
+            exit(0);
         }
-        return t;
+        return Tensor3DView< Type>(tensor.data() + (z * rows() + y) * cols() + x, p, q, r,
+                                   cols(), rows() * cols());
+    }
+
+    Tensor3DView< const Type> view() const{
+        return Tensor3DView< const Type>(tensor.data(), depths(), rows(), cols(), cols(), rows() * cols());
+    }
+
+    Tensor3DView< Type> view(){
+        return Tensor3DView< Type>(tensor.data(), depths(), rows(), cols(), cols(), rows() * cols());
     }
 
     Eigen::Matrix<Type, 1, Eigen::Dynamic, Eigen::RowMajor> row( int z, int y) const{
@@ -518,16 +626,7 @@ public:
     }
 
     Scalar lvlSquaredNorm() const{
-        Scalar res = 0;
-        for (int i = 0; i < depths(); ++i) {
-            for (int j = 0; j < rows(); ++j) {
-                for (int k = 0; k < cols(); ++k) {
-                    for (int l = 0; l < 352; ++l) {
-                        res += tensor(i, j, k)(l) * tensor(i, j, k)(l);/* * tensor(i, j, k)(l)*/;
-                    }
-                }
-            }
-        }
+        Scalar res = FFLD::CellKernels::Dot(scalars(), scalars(), size() * CellScalars);
         return sqrt(res);//pow(res, 1/3.0);
     }
 
@@ -581,4 +680,105 @@ public:
 typedef Tensor3D<Scalar> Tensor3DF;
 typedef Tensor3D<int> Tensor3DI;
 
+/// Tensors of possibly different sizes (typically one per box of a pyramid level) stored one after
+/// the other in a single buffer. The tensor of box i is the view (*this)[i], so pack[box](z, y, x)
+/// reads like the vector<Tensor3D> it replaces, without an allocation per box.
+template <typename Type>
+class Tensor3DPack{
+public:
+    Tensor3DPack() : offsets_(1, 0)
+    {}
+
+    /// Allocates one tensor of size (depths, rows, cols) per element of @p sizes, the previous
+    /// content is lost. The sizes with a non positive dimension give empty tensors.
+    void resize( const std::vector<Eigen::Vector3i>& sizes){
+        sizes_ = sizes;
+        offsets_.resize( sizes.size() + 1);
+        offsets_[0] = 0;
+        for (int i = 0; i < sizes.size(); ++i) {
+            if( sizes_[i].minCoeff() <= 0){
+                sizes_[i].setZero();
+            }
+            offsets_[i + 1] = offsets_[i] + sizes_[i].prod();
+        }
+        data_.resize( offsets_.back());
+    }
+
+    /// Allocates tensors of the same sizes as the ones of @p pack.
+    template <typename Other>
+    void resizeLike( const Tensor3DPack< Other>& pack){
+        resize( pack.sizes());
+    }
+
+    /// Releases the buffer.
+    void clear(){
+        sizes_.clear();
+        offsets_.assign( 1, 0);
+        Buffer().swap( data_);
+    }
+
+    void swap( Tensor3DPack& pack){
+        data_.swap( pack.data_);
+        offsets_.swap( pack.offsets_);
+        sizes_.swap( pack.sizes_);
+    }
+
+    /// Number of tensors.
+    int size() const{
+        return sizes_.size();
+    }
+
+    bool empty() const{
+        return sizes_.empty();
+    }
+
+    /// Size (depths, rows, cols) of each tensor.
+    const std::vector<Eigen::Vector3i>& sizes() const{
+        return sizes_;
+    }
+
+    /// Index in data() of the first element of tensor i.
+    int offset( int i) const{
+        return offsets_[i];
+    }
+
+    /// Total number of elements of all the tensors.
+    int nbElements() const{
+        return offsets_.back();
+    }
+
+    Type* data(){
+        return data_.data();
+    }
+
+    const Type* data() const{
+        return data_.data();
+    }
+
+    Tensor3DView< Type> operator[]( int i){
+        return Tensor3DView< Type>( data_.data() + offsets_[i], sizes_[i](0), sizes_[i](1), sizes_[i](2),
+                                    sizes_[i](2), sizes_[i](1) * sizes_[i](2));
+    }
+
+    Tensor3DView< const Type> operator[]( int i) const{
+        return Tensor3DView< const Type>( data_.data() + offsets_[i], sizes_[i](0), sizes_[i](1),
+                                          sizes_[i](2), sizes_[i](2), sizes_[i](1) * sizes_[i](2));
+    }
+
+    void setConstant( const Type& value){
+        std::fill( data_.begin(), data_.end(), value);
+    }
+
+private:
+    typedef std::vector<Type, Eigen::aligned_allocator<Type> > Buffer;
+
+    Buffer data_;
+    std::vector<int> offsets_;
+    std::vector<Eigen::Vector3i> sizes_;
+};
+
+/// Type of the scores of all the boxes of a pyramid level.
+typedef Tensor3DPack<Scalar> Tensor3DPackF;
+typedef Tensor3DPack<int> Tensor3DPackI;
+
 #endif // TENSOR3D_H
@@ -0,0 +1,775 @@
+#include "CellKernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FFLD_CELLKERNELS_X86
+#include <immintrin.h>
+#endif
+
+using namespace FFLD;
+using namespace std;
+
+namespace
+{
+// Plain C++ kernels, also used for the remainders of the vectorized ones
+float DotScalar(const float * a, const float * b, int n)
+{
+	float res = 0;
+
+	for (int i = 0; i < n; ++i)
+		res += a[i] * b[i];
+
+	return res;
+}
+
+void AxpyScalar(float alpha, const float * x, float * y, int n)
+{
+	for (int i = 0; i < n; ++i)
+		y[i] += alpha * x[i];
+}
+
+void ScaleScalar(float alpha, float * x, int n)
+{
+	for (int i = 0; i < n; ++i)
+		x[i] *= alpha;
+}
+
+float SquaredDistanceScalar(const float * a, const float * b, int n)
+{
+	float res = 0;
+
+	for (int i = 0; i < n; ++i)
+		res += (a[i] - b[i]) * (a[i] - b[i]);
+
+	return res;
+}
+
+float ChiSquareScalar(const float * a, const float * b, int n)
+{
+	float res = 0;
+
+	for (int i = 0; i < n; ++i) {
+		const float denominator = std::abs(a[i]) + std::abs(b[i]);
+
+		if (denominator != 0)
+			res += (a[i] - b[i]) * (a[i] - b[i]) / denominator;
+	}
+
+	return res;
+}
+
+// The lanes advance in lockstep and branch free, as the data dependent branches of a single
+// envelope are mostly mispredicted
+void DistanceTransformScalar(const float * f, int n, float a, float b, const float * t, float * z,
+							 int * v, float * y, int * m)
+{
+	const int L = CellKernels::DTLanes;
+	int k[L];	// Index of the rightmost parabola of each lower envelope
+	float s[L];
+
+	for (int l = 0; l < L; ++l) {
+		z[l] = -numeric_limits<float>::infinity();	// Boundaries between the parabolas
+		v[l] = 0;									// Locations of the parabolas
+		k[l] = 0;
+	}
+
+	for (int q = 1; q < n; ++q) {
+		bool pop;
+
+		do {
+			pop = false;
+
+			for (int l = 0; l < L; ++l) {
+				const int vk = v[k[l] * L + l];
+				s[l] = (f[q * L + l] - f[vk * L + l]) * t[q - vk] + (q + vk) - b / a;
+
+				const bool below = s[l] <= z[k[l] * L + l];
+				k[l] -= below;
+				pop |= below;
+			}
+		}
+		while (pop);
+
+		for (int l = 0; l < L; ++l) {
+			++k[l];
+			v[k[l] * L + l] = q;
+			z[k[l] * L + l] = s[l];
+		}
+	}
+
+	for (int l = 0; l < L; ++l) {
+		z[(k[l] + 1) * L + l] = numeric_limits<float>::infinity();
+		k[l] = 0;
+	}
+
+	for (int q = 0; q < n; ++q) {
+		bool next;
+
+		do {
+			next = false;
+
+			for (int l = 0; l < L; ++l) {
+				const bool beyond = z[(k[l] + 1) * L + l] < 2 * q;
+				k[l] += beyond;
+				next |= beyond;
+			}
+		}
+		while (next);
+
+		for (int l = 0; l < L; ++l) {
+			const int vk = v[k[l] * L + l];
+			m[q * L + l] = vk;
+			y[q * L + l] = f[vk * L + l] + (a * (q - vk) + b) * (q - vk);
+		}
+	}
+}
+
+#ifdef FFLD_CELLKERNELS_X86
+// The distance transforms must not contract their products and sums into FMAs, to find the same
+// parabolas and scores as the plain C++ version
+#ifdef __clang__
+#define FFLD_NO_CONTRACT
+#else
+#define FFLD_NO_CONTRACT __attribute__((optimize("fp-contract=off")))
+#endif
+
+// SSE2 (always available on x86-64), 2 accumulators of 4 floats
+__attribute__((target("sse2")))
+float HorizontalSum(__m128 x)
+{
+	x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+	x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+	return _mm_cvtss_f32(x);
+}
+
+__attribute__((target("sse2")))
+float DotSSE(const float * a, const float * b, int n)
+{
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+
+	return HorizontalSum(_mm_add_ps(sum0, sum1)) + DotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void AxpySSE(float alpha, const float * x, float * y, int n)
+{
+	const __m128 a = _mm_set1_ps(alpha);
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(a, _mm_loadu_ps(x + i))));
+
+	AxpyScalar(alpha, x + i, y + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void ScaleSSE(float alpha, float * x, int n)
+{
+	const __m128 a = _mm_set1_ps(alpha);
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(x + i, _mm_mul_ps(a, _mm_loadu_ps(x + i)));
+
+	ScaleScalar(alpha, x + i, n - i);
+}
+
+__attribute__((target("sse2")))
+float SquaredDistanceSSE(const float * a, const float * b, int n)
+{
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		const __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+		const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+	}
+
+	return HorizontalSum(_mm_add_ps(sum0, sum1)) + SquaredDistanceScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+float ChiSquareSSE(const float * a, const float * b, int n)
+{
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const __m128 zero = _mm_setzero_ps();
+	__m128 sum = _mm_setzero_ps();
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		const __m128 x = _mm_loadu_ps(a + i);
+		const __m128 y = _mm_loadu_ps(b + i);
+		const __m128 d = _mm_sub_ps(x, y);
+		const __m128 den = _mm_add_ps(_mm_andnot_ps(signMask, x), _mm_andnot_ps(signMask, y));
+
+		// The lanes with a null denominator (0 / 0) are masked out
+		sum = _mm_add_ps(sum, _mm_and_ps(_mm_cmpneq_ps(den, zero),
+										 _mm_div_ps(_mm_mul_ps(d, d), den)));
+	}
+
+	return HorizontalSum(sum) + ChiSquareScalar(a + i, b + i, n - i);
+}
+
+// AVX2 + FMA, 2 accumulators of 8 floats
+__attribute__((target("avx2,fma")))
+float HorizontalSum(__m256 x)
+{
+	return HorizontalSum(_mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+float DotAVX2(const float * a, const float * b, int n)
+{
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+		sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+	}
+
+	if (i + 8 <= n) {
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+		i += 8;
+	}
+
+	return HorizontalSum(_mm256_add_ps(sum0, sum1)) + DotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+void AxpyAVX2(float alpha, const float * x, float * y, int n)
+{
+	const __m256 a = _mm256_set1_ps(alpha);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+
+	AxpyScalar(alpha, x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+void ScaleAVX2(float alpha, float * x, int n)
+{
+	const __m256 a = _mm256_set1_ps(alpha);
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(x + i, _mm256_mul_ps(a, _mm256_loadu_ps(x + i)));
+
+	ScaleScalar(alpha, x + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+float SquaredDistanceAVX2(const float * a, const float * b, int n)
+{
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+		const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+		sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+		sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+	}
+
+	if (i + 8 <= n) {
+		const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+		sum0 = _mm256_fmadd_ps(d, d, sum0);
+		i += 8;
+	}
+
+	return HorizontalSum(_mm256_add_ps(sum0, sum1)) + SquaredDistanceScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+float ChiSquareAVX2(const float * a, const float * b, int n)
+{
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 sum = _mm256_setzero_ps();
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		const __m256 x = _mm256_loadu_ps(a + i);
+		const __m256 y = _mm256_loadu_ps(b + i);
+		const __m256 d = _mm256_sub_ps(x, y);
+		const __m256 den = _mm256_add_ps(_mm256_andnot_ps(signMask, x),
+										 _mm256_andnot_ps(signMask, y));
+
+		sum = _mm256_add_ps(sum, _mm256_and_ps(_mm256_cmp_ps(den, zero, _CMP_NEQ_OQ),
+											   _mm256_div_ps(_mm256_mul_ps(d, d), den)));
+	}
+
+	return HorizontalSum(sum) + ChiSquareScalar(a + i, b + i, n - i);
+}
+
+// 8 of the lanes of a distance transform, starting at lane first. The top of each envelope is
+// kept in registers, only the lanes popping a parabola gather the next one
+__attribute__((target("avx2,fma"))) FFLD_NO_CONTRACT
+void DistanceTransformAVX2Lanes(const float * f, int n, float a, float b, const float * t,
+								float * z, int * v, float * y, int * m, int first)
+{
+	const int L = CellKernels::DTLanes;
+	const __m256i lane = _mm256_setr_epi32(first, first + 1, first + 2, first + 3, first + 4,
+										   first + 5, first + 6, first + 7);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256 offset = _mm256_set1_ps(b / a);
+	__m256i k = _mm256_setzero_si256();	// Index of the rightmost parabola of each lower envelope
+	__m256i vk = _mm256_setzero_si256();
+	__m256 fvk = _mm256_loadu_ps(f + first);
+	__m256 zk = _mm256_set1_ps(-numeric_limits<float>::infinity());
+	int stored[8];
+	float boundaries[8];
+
+	_mm256_storeu_ps(z + first, zk);
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(v + first), vk);
+
+	for (int q = 1; q < n; ++q) {
+		const __m256i qs = _mm256_set1_epi32(q);
+		const __m256 fq = _mm256_loadu_ps(f + q * L + first);
+		__m256 s;
+
+		for (;;) {
+			const __m256 tq = _mm256_i32gather_ps(t, _mm256_sub_epi32(qs, vk), 4);
+
+			s = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(fq, fvk), tq),
+											_mm256_cvtepi32_ps(_mm256_add_epi32(qs, vk))), offset);
+
+			const __m256 below = _mm256_cmp_ps(s, zk, _CMP_LE_OQ);
+
+			if (!_mm256_movemask_ps(below))
+				break;
+
+			// The comparison is all ones (-1) in the lanes to pop
+			k = _mm256_add_epi32(k, _mm256_castps_si256(below));
+
+			const __m256i index = _mm256_add_epi32(_mm256_slli_epi32(k, 4), lane);
+			vk = _mm256_mask_i32gather_epi32(vk, v, index, _mm256_castps_si256(below), 4);
+			fvk = _mm256_mask_i32gather_ps(fvk, f, _mm256_add_epi32(_mm256_slli_epi32(vk, 4), lane),
+										   below, 4);
+			zk = _mm256_mask_i32gather_ps(zk, z, index, below, 4);
+		}
+
+		k = _mm256_add_epi32(k, one);
+		vk = qs;
+		fvk = fq;
+		zk = s;
+
+		// No scatter before AVX-512
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(stored), k);
+		_mm256_storeu_ps(boundaries, s);
+
+		for (int l = 0; l < 8; ++l) {
+			v[stored[l] * L + first + l] = q;
+			z[stored[l] * L + first + l] = boundaries[l];
+		}
+	}
+
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(stored), k);
+
+	for (int l = 0; l < 8; ++l)
+		z[(stored[l] + 1) * L + first + l] = numeric_limits<float>::infinity();
+
+	// Walk the envelopes, the next boundary and the current parabola being kept in registers
+	k = _mm256_setzero_si256();
+	vk = _mm256_setzero_si256();
+	fvk = _mm256_loadu_ps(f + first);
+	__m256 next = _mm256_loadu_ps(z + L + first);
+
+	for (int q = 0; q < n; ++q) {
+		const __m256 q2 = _mm256_set1_ps(2 * q);
+
+		for (;;) {
+			const __m256 beyond = _mm256_cmp_ps(next, q2, _CMP_LT_OQ);
+
+			if (!_mm256_movemask_ps(beyond))
+				break;
+
+			k = _mm256_sub_epi32(k, _mm256_castps_si256(beyond));
+
+			const __m256i index = _mm256_add_epi32(_mm256_slli_epi32(k, 4), lane);
+			vk = _mm256_mask_i32gather_epi32(vk, v, index, _mm256_castps_si256(beyond), 4);
+			fvk = _mm256_mask_i32gather_ps(fvk, f, _mm256_add_epi32(_mm256_slli_epi32(vk, 4), lane),
+										   beyond, 4);
+			next = _mm256_mask_i32gather_ps(next, z, _mm256_add_epi32(index, _mm256_set1_epi32(L)),
+											beyond, 4);
+		}
+
+		const __m256 d = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_set1_epi32(q), vk));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(m + q * L + first), vk);
+		_mm256_storeu_ps(y + q * L + first,
+						 _mm256_add_ps(fvk, _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(a), d),
+																		_mm256_set1_ps(b)), d)));
+	}
+}
+
+__attribute__((target("avx2,fma")))
+void DistanceTransformAVX2(const float * f, int n, float a, float b, const float * t, float * z,
+						   int * v, float * y, int * m)
+{
+	DistanceTransformAVX2Lanes(f, n, a, b, t, z, v, y, m, 0);
+	DistanceTransformAVX2Lanes(f, n, a, b, t, z, v, y, m, 8);
+}
+
+// AVX-512, 16 floats per register (352 = 22 x 16)
+__attribute__((target("avx512f")))
+float DotAVX512(const float * a, const float * b, int n)
+{
+	__m512 sum0 = _mm512_setzero_ps();
+	__m512 sum1 = _mm512_setzero_ps();
+	int i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+		sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+	}
+
+	if (i + 16 <= n) {
+		sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+		i += 16;
+	}
+
+	return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1)) + DotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+void AxpyAVX512(float alpha, const float * x, float * y, int n)
+{
+	const __m512 a = _mm512_set1_ps(alpha);
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+		_mm512_storeu_ps(y + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+
+	AxpyScalar(alpha, x + i, y + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+void ScaleAVX512(float alpha, float * x, int n)
+{
+	const __m512 a = _mm512_set1_ps(alpha);
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+		_mm512_storeu_ps(x + i, _mm512_mul_ps(a, _mm512_loadu_ps(x + i)));
+
+	ScaleScalar(alpha, x + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+float SquaredDistanceAVX512(const float * a, const float * b, int n)
+{
+	__m512 sum0 = _mm512_setzero_ps();
+	__m512 sum1 = _mm512_setzero_ps();
+	int i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		const __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+		const __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+		sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+		sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+	}
+
+	if (i + 16 <= n) {
+		const __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+		sum0 = _mm512_fmadd_ps(d, d, sum0);
+		i += 16;
+	}
+
+	return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1)) +
+		   SquaredDistanceScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+float ChiSquareAVX512(const float * a, const float * b, int n)
+{
+	const __m512 zero = _mm512_setzero_ps();
+	__m512 sum = _mm512_setzero_ps();
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		const __m512 x = _mm512_loadu_ps(a + i);
+		const __m512 y = _mm512_loadu_ps(b + i);
+		const __m512 d = _mm512_sub_ps(x, y);
+		const __m512 den = _mm512_add_ps(_mm512_abs_ps(x), _mm512_abs_ps(y));
+		const __mmask16 nonZero = _mm512_cmp_ps_mask(den, zero, _CMP_NEQ_OQ);
+
+		sum = _mm512_mask_add_ps(sum, nonZero, sum,
+								 _mm512_maskz_div_ps(nonZero, _mm512_mul_ps(d, d), den));
+	}
+
+	return _mm512_reduce_add_ps(sum) + ChiSquareScalar(a + i, b + i, n - i);
+}
+
+// The 16 lanes of a distance transform in one register, with the scatters of AVX-512. The top
+// of each envelope is kept in registers, only the lanes popping a parabola gather the next one
+__attribute__((target("avx512f"))) FFLD_NO_CONTRACT
+void DistanceTransformAVX512(const float * f, int n, float a, float b, const float * t, float * z,
+							 int * v, float * y, int * m)
+{
+	const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m512i one = _mm512_set1_epi32(1);
+	const __m512 offset = _mm512_set1_ps(b / a);
+	const __m512 infinity = _mm512_set1_ps(numeric_limits<float>::infinity());
+	__m512i k = _mm512_setzero_si512();	// Index of the rightmost parabola of each lower envelope
+	__m512i vk = _mm512_setzero_si512();
+	__m512 fvk = _mm512_loadu_ps(f);
+	__m512 zk = _mm512_set1_ps(-numeric_limits<float>::infinity());
+
+	_mm512_storeu_ps(z, zk);
+	_mm512_storeu_si512(v, vk);
+
+	for (int q = 1; q < n; ++q) {
+		const __m512i qs = _mm512_set1_epi32(q);
+		const __m512 fq = _mm512_loadu_ps(f + q * 16);
+		__m512 s;
+
+		for (;;) {
+			const __m512 tq = _mm512_i32gather_ps(_mm512_sub_epi32(qs, vk), t, 4);
+
+			s = _mm512_sub_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_sub_ps(fq, fvk), tq),
+											_mm512_cvtepi32_ps(_mm512_add_epi32(qs, vk))), offset);
+
+			const __mmask16 below = _mm512_cmp_ps_mask(s, zk, _CMP_LE_OQ);
+
+			if (!below)
+				break;
+
+			k = _mm512_mask_sub_epi32(k, below, k, one);
+
+			const __m512i index = _mm512_add_epi32(_mm512_slli_epi32(k, 4), lane);
+			vk = _mm512_mask_i32gather_epi32(vk, below, index, v, 4);
+			fvk = _mm512_mask_i32gather_ps(fvk, below, _mm512_add_epi32(_mm512_slli_epi32(vk, 4), lane), f, 4);
+			zk = _mm512_mask_i32gather_ps(zk, below, index, z, 4);
+		}
+
+		k = _mm512_add_epi32(k, one);
+		vk = qs;
+		fvk = fq;
+		zk = s;
+
+		const __m512i index = _mm512_add_epi32(_mm512_slli_epi32(k, 4), lane);
+		_mm512_i32scatter_epi32(v, index, qs, 4);
+		_mm512_i32scatter_ps(z, index, s, 4);
+	}
+
+	_mm512_i32scatter_ps(z, _mm512_add_epi32(_mm512_slli_epi32(_mm512_add_epi32(k, one), 4), lane),
+						 infinity, 4);
+
+	// Walk the envelopes, the next boundary and the current parabola being kept in registers
+	k = _mm512_setzero_si512();
+	vk = _mm512_setzero_si512();
+	fvk = _mm512_loadu_ps(f);
+	__m512 next = _mm512_loadu_ps(z + 16);
+
+	for (int q = 0; q < n; ++q) {
+		const __m512 q2 = _mm512_set1_ps(2 * q);
+
+		for (;;) {
+			const __mmask16 beyond = _mm512_cmp_ps_mask(next, q2, _CMP_LT_OQ);
+
+			if (!beyond)
+				break;
+
+			k = _mm512_mask_add_epi32(k, beyond, k, one);
+
+			const __m512i index = _mm512_add_epi32(_mm512_slli_epi32(k, 4), lane);
+			vk = _mm512_mask_i32gather_epi32(vk, beyond, index, v, 4);
+			fvk = _mm512_mask_i32gather_ps(fvk, beyond, _mm512_add_epi32(_mm512_slli_epi32(vk, 4), lane), f, 4);
+			next = _mm512_mask_i32gather_ps(next, beyond, _mm512_add_epi32(index, _mm512_set1_epi32(16)), z, 4);
+		}
+
+		const __m512 d = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_set1_epi32(q), vk));
+
+		_mm512_storeu_si512(m + q * 16, vk);
+		_mm512_storeu_ps(y + q * 16,
+						 _mm512_add_ps(fvk, _mm512_mul_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(a), d),
+																		_mm512_set1_ps(b)), d)));
+	}
+}
+#endif
+
+// Table of the kernels for the instruction set selected at startup
+struct Kernels
+{
+	const char * name;
+	float (*dot)(const float *, const float *, int);
+	void (*axpy)(float, const float *, float *, int);
+	void (*scale)(float, float *, int);
+	float (*squaredDistance)(const float *, const float *, int);
+	float (*chiSquare)(const float *, const float *, int);
+	void (*distanceTransform)(const float *, int, float, float, const float *, float *, int *,
+							  float *, int *);
+};
+
+Kernels Select()
+{
+#ifdef FFLD_CELLKERNELS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		const Kernels kernels = {"avx512", DotAVX512, AxpyAVX512, ScaleAVX512,
+								 SquaredDistanceAVX512, ChiSquareAVX512, DistanceTransformAVX512};
+		return kernels;
+	}
+
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		const Kernels kernels = {"avx2", DotAVX2, AxpyAVX2, ScaleAVX2, SquaredDistanceAVX2,
+								 ChiSquareAVX2, DistanceTransformAVX2};
+		return kernels;
+	}
+
+	if (__builtin_cpu_supports("sse2")) {
+		const Kernels kernels = {"sse", DotSSE, AxpySSE, ScaleSSE, SquaredDistanceSSE,
+								 ChiSquareSSE, DistanceTransformScalar};
+		return kernels;
+	}
+#endif
+	const Kernels kernels = {"scalar", DotScalar, AxpyScalar, ScaleScalar, SquaredDistanceScalar,
+							 ChiSquareScalar, DistanceTransformScalar};
+	return kernels;
+}
+
+// Function local so that it is initialized before any use from another static initializer
+const Kernels & Selected()
+{
+	static const Kernels kernels = Select();
+	return kernels;
+}
+}
+
+float CellKernels::Dot(const float * a, const float * b, int n)
+{
+	return Selected().dot(a, b, n);
+}
+
+void CellKernels::Axpy(float alpha, const float * x, float * y, int n)
+{
+	Selected().axpy(alpha, x, y, n);
+}
+
+void CellKernels::Scale(float alpha, float * x, int n)
+{
+	Selected().scale(alpha, x, n);
+}
+
+float CellKernels::SquaredDistance(const float * a, const float * b, int n)
+{
+	return Selected().squaredDistance(a, b, n);
+}
+
+float CellKernels::ChiSquare(const float * a, const float * b, int n)
+{
+	return Selected().chiSquare(a, b, n);
+}
+
+void CellKernels::DistanceTransform(const float * f, int n, float a, float b, const float * t,
+									float * z, int * v, float * y, int * m)
+{
+	Selected().distanceTransform(f, n, a, b, t, z, v, y, m);
+}
+
+float CellKernels::ThresholdedEMD(const float * p, const float * q, int n, float threshold,
+								  float extraMassPenalty)
+{
+	// The thresholded distance is the shortest path distance of the line of bins (steps of cost 1)
+	// plus a threshold node reached for free and left at the cost of the threshold, which also
+	// absorbs the surplus of p (as in emd_hat). The flow on the edge k -> k + 1 of the line is
+	// then S_k - H_k, with S the cumulative sums of p - q and H those of the flows into the
+	// threshold node, and the EMD is the minimum over H of
+	// sum_k |S_k - H_k| + threshold * sum_k max(H_(k-1) - H_k, 0), with H_-1 = 0 and H_n-1 = S_n-1.
+	// There is an optimal H taking its values among the cumulative sums (and 0), hence a dynamic
+	// program over those candidates.
+	if (n <= 0)
+		return 0;
+	
+	const int MaxBins = 64;
+	float stackBuffer[4 * (MaxBins + 1)];
+	vector<float> heapBuffer;
+	float * buffer = stackBuffer;
+	
+	if (n > MaxBins) {
+		heapBuffer.resize(4 * (n + 1));
+		buffer = &heapBuffer[0];
+	}
+	
+	float * sums = buffer;
+	float * candidates = sums + n;
+	float * costs = candidates + n + 1;
+	float * transformed = costs + n + 1;
+	
+	// The heavier histogram is the source (the ground distance is symmetric)
+	float sign = 1;
+	float sum = 0;
+	
+	for (int i = 0; i < n; ++i)
+		sum += p[i] - q[i];
+	
+	if (sum < 0)
+		sign = -1;
+	
+	sum = 0;
+	
+	for (int i = 0; i < n; ++i) {
+		sum += sign * (p[i] - q[i]);
+		sums[i] = sum;
+		candidates[i] = sum;
+	}
+	
+	candidates[n] = 0;
+	std::sort(candidates, candidates + n + 1);
+	const int nbCandidates = static_cast<int>(std::unique(candidates, candidates + n + 1) - candidates);
+	const float surplus = sums[n - 1];
+	const float infinity = numeric_limits<float>::infinity();
+	
+	for (int j = 0; j < nbCandidates; ++j)
+		costs[j] = (candidates[j] == 0) ? 0 : infinity;
+	
+	for (int k = 0; k < n; ++k) {
+		// Decreasing H costs the threshold per unit, increasing it is free
+		float best = infinity;
+		
+		for (int j = 0; j < nbCandidates; ++j) {
+			best = std::min(best, costs[j]);
+			transformed[j] = best;
+		}
+		
+		best = infinity;
+		
+		for (int j = nbCandidates - 1; j >= 0; --j) {
+			transformed[j] = std::min(transformed[j], best - threshold * candidates[j]);
+			best = std::min(best, costs[j] + threshold * candidates[j]);
+		}
+		
+		for (int j = 0; j < nbCandidates; ++j)
+			costs[j] = transformed[j] + ((k < n - 1) ? std::abs(sums[k] - candidates[j]) : 0);
+	}
+	
+	const int last = static_cast<int>(std::lower_bound(candidates, candidates + nbCandidates, surplus) -
+									   candidates);
+	
+	return costs[last] + surplus * extraMassPenalty;
+}
+
+const char * CellKernels::InstructionSet()
+{
+	return Selected().name;
+}
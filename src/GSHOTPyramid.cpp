@@ -1,21 +1,34 @@
 #include "GSHOTPyramid.h"
 
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <utility>
+
 using namespace Eigen;
 using namespace FFLD;
 using namespace std;
 
 
 const int GSHOTPyramid::DescriptorSize;
+const int GSHOTPyramid::BinaryVersion;
 
 GSHOTPyramid::GSHOTPyramid() : interval_(0), nbOctave_(0)
 {
 }
 
-GSHOTPyramid::GSHOTPyramid(const GSHOTPyramid& pyr) : interval_(pyr.interval()), nbOctave_(pyr.nbOctave_),
-    filterSizes_(pyr.filterSizes_), levels_(pyr.levels()), resolutions_(pyr.resolutions()),
+GSHOTPyramid::GSHOTPyramid(const GSHOTPyramid& pyr) : pad_(pyr.pad_), interval_(pyr.interval()),
+    nbOctave_(pyr.nbOctave_), nbParts_(pyr.nbParts_), filterSizes_(pyr.filterSizes_),
+    levels_(pyr.levels()), squaredNorms_(pyr.squaredNorms_), resolutions_(pyr.resolutions()),
     keyPts_(pyr.keyPts_), rectangles_(pyr.rectangles_),topology_(pyr.topology_),
     sceneOffset_(pyr.sceneOffset_),globalKeyPts(pyr.globalKeyPts),
-    globalDescriptors(pyr.globalDescriptors)
+    globalDescriptors(pyr.globalDescriptors), surface_(pyr.surface_),
+    surfaceNormals_(pyr.surfaceNormals_), surfaceTree_(pyr.surfaceTree_)
 {
 }
 
@@ -68,6 +81,9 @@ void GSHOTPyramid::createFullPyramid(const PointCloudPtr input, PointType min,
     cout << "GSHOTPyr::createFullPyramid input->size() : "<<input->size()<<endl;
     cout << "GSHOTPyr::createFullPyramid subspace->size() : "<<subspace->size()<<endl;
 
+    // Normals and search tree are computed once for the whole scene
+    setSearchSurface(subspace);
+
 
 //    float orientationFrom[9] = {0,0,1,1,0,0,0,1,0};
     float orientationFrom[9] = {0,1,0,0,0,1,1,0,0};
@@ -173,31 +189,14 @@ void GSHOTPyramid::createFullPyramid(const PointCloudPtr input, PointType min,
 //                    cout<<"Keypts1 : "<<keypoints_[lvl][i]->points[0]<<endl;
 //                    cout<<"Keypts2 : "<<keypoints_[lvl][i]->points[1]<<endl;
 
-            DescriptorsPtr descriptors = compute_descriptor(subspace, keyPts_[lvl][i],
-                                                            descRadius/pow(nbParts_, 0.33));
-//                    cout << "GSHOTPyr::constructor compute_descriptor done"<<endl;
-
-            Level level( topology_[lvl](0), topology_[lvl](1), topology_[lvl](2));
-            int kpt = 0;
-            for (int z = 0; z < level.depths(); ++z){
-                for (int y = 0; y < level.rows(); ++y){
-                    for (int x = 0; x < level.cols(); ++x){
-                        for( int k = 0; k < GSHOTPyramid::DescriptorSize; ++k){
-                            level()(z, y, x)(k) = descriptors->points[kpt].descriptor[k];
-                        }
-                        ++kpt;
-                    }
-                }
-            }
-
-            //Once the first level is done, push it to the array of level
-            levels_[lvl][i] = level;
-//                    cout << "GSHOTPyr::constructor fillLevel done"<<endl;
-
 //            cout<<"Keypts : "<<keypoints_[1][i]->points[0]<<endl;
 
         ++cpt;
     }
+
+    // The descriptors of all the boxes are computed in a single pass
+    computeBoxesDescriptors(subspace, 0, descRadius/pow(nbParts_, 0.33));
+    computeSquaredNorms();
 }
 
 PointCloudPtr GSHOTPyramid::createPosPyramid(const PointCloudPtr input, vector<Vector3i> colors,
@@ -394,6 +393,9 @@ PointCloudPtr GSHOTPyramid::createFilteredPyramid(const PointCloudPtr input, Lev
     sampling.setRadiusSearch (resolutions_[0]);
     sampling.filter(*subspace);
 
+    // Normals and search tree are computed once for the whole scene
+    setSearchSurface(subspace);
+
 //    float orientationFrom[9] = {0,0,1,1,0,0,0,1,0};
 //    float orientationFrom[9] = {0,1,0,0,0,1,1,0,0};
     //old chair
@@ -427,8 +429,8 @@ PointCloudPtr GSHOTPyramid::createFilteredPyramid(const PointCloudPtr input, Lev
 
     int cpt0 = 0;
     for(int i=0;i<globalDescriptors->size();++i){
-        Cell desc( globalDescriptors->points[i].descriptor);
-        if(rootFilter()(0,0,0).matrix().dot(desc.matrix()) >= accuracyThreshold){
+        if(CellKernels::Dot(rootFilter()(0,0,0).data(), globalDescriptors->points[i].descriptor,
+                            DescriptorSize) >= accuracyThreshold){
             Level level( 1,1,1);
             for(int j=0;j<DescriptorSize;++j){
                 level()(0,0,0)(j) = globalDescriptors->points[i].descriptor[j];
@@ -509,32 +511,16 @@ PointCloudPtr GSHOTPyramid::createFilteredPyramid(const PointCloudPtr input, Lev
 //                    cout<<"Keypts1 : "<<keypoints_[lvl][i]->points[0]<<endl;
 //                    cout<<"Keypts2 : "<<keypoints_[lvl][i]->points[1]<<endl;
 
-                    DescriptorsPtr descriptors = compute_descriptor(subspace, keyPts_[lvl][i],
-                                                                    descRadius/pow(nbParts_, 0.33));
-
-                    Level level( topology_[lvl](0), topology_[lvl](1), topology_[lvl](2));
-                    int kpt = 0;
-                    for (int z = 0; z < level.depths(); ++z){
-                        for (int y = 0; y < level.rows(); ++y){
-                            for (int x = 0; x < level.cols(); ++x){
-                                for( int k = 0; k < GSHOTPyramid::DescriptorSize; ++k){
-                                    level()(z, y, x)(k) = descriptors->points[kpt].descriptor[k];
-                                }
-                                ++kpt;
-                            }
-                        }
-                    }
-
-                    //Once the first level is done, push it to the array of level
-                    levels_[lvl][i] = level;
-//                    cout << "GSHOTPyr::constructor fillLevel done"<<endl;
-
 //                }
 //            }
 //            cout<<"Keypts : "<<keypoints_[1][i]->points[0]<<endl;
 
         ++cpt;
     }
+
+    // The descriptors of all the boxes are computed in a single pass
+    computeBoxesDescriptors(subspace, 0, descRadius/pow(nbParts_, 0.33));
+    computeSquaredNorms();
     cout << "GSHOTPyr::constructor done"<<endl;
 
     return subspace;
@@ -591,7 +577,7 @@ void GSHOTPyramid::convolve(const Level & filter, vector<vector<Tensor3DF > >& c
     for (int i = 0; i < levels_.size(); ++i){
         convolutions[i].resize(levels_[i].size());
 //        cout<<"GSHOTPyramid::convolve at lvl : "<< i << endl;
-//        #pragma omp parallel for
+        #pragma omp parallel for
         for (int j = 0; j < levels_[i].size(); ++j){
             Convolve(levels_[i][j], filter, convolutions[i][j]);
         }
@@ -599,20 +585,369 @@ void GSHOTPyramid::convolve(const Level & filter, vector<vector<Tensor3DF > >& c
     cout<<"GSHOTPyramid::convolve done"<<endl;
 }
 
+void GSHOTPyramid::RBFconvolve(const Level & filter, vector<vector<Tensor3DF> > & convolutions) const
+{
+    convolutions.resize(levels_.size());
+
+    for (int lvl = 0; lvl < levels_.size(); ++lvl){
+        convolutions[lvl].resize(levels_[lvl].size());
+
+        #pragma omp parallel for
+        for (int box = 0; box < levels_[lvl].size(); ++box){
+            // The norms are recomputed if levels_ was modified without computeSquaredNorms()
+            if ((lvl < squaredNorms_.size()) && (box < squaredNorms_[lvl].size()) &&
+                (squaredNorms_[lvl][box].size() == levels_[lvl][box].size())){
+                convolutions[lvl][box] = levels_[lvl][box].RBFconvolve(filter, squaredNorms_[lvl][box]);
+            }
+            else{
+                convolutions[lvl][box] = levels_[lvl][box].RBFconvolve(filter);
+            }
+        }
+    }
+}
+
+namespace
+{
+// Size of the patches of a batch of boxes, small enough for the matrix product to run from the cache
+const int BatchBytes = 1024 * 1024;
+
+template <int N>
+bool IsCube(const GSHOTPyramid::Level & filter)
+{
+    return (filter.depths() == N) && (filter.rows() == N) && (filter.cols() == N);
+}
+
+// Whether Convolve(level, filter, convolution) has an unrolled kernel for the filter
+bool IsFixed(const GSHOTPyramid::Level & filter)
+{
+    return IsCube<1>(filter) || IsCube<2>(filter) || IsCube<3>(filter);
+}
+}
+
+void GSHOTPyramid::convolve(const vector<const Level *> & filters,
+                            vector<vector<vector<Tensor3DF> > > & convolutions) const
+{
+    convolutions.resize(filters.size());
+
+    for (int i = 0; i < filters.size(); ++i){
+        convolutions[i].resize(levels_.size());
+        for (int lvl = 0; lvl < levels_.size(); ++lvl){
+            convolutions[i][lvl].resize(levels_[lvl].size());
+        }
+    }
+
+    // Group the filters of identical dimensions
+    vector<vector<const Level *> > groups;
+    vector<vector<int> > indices;
+    for (int i = 0; i < filters.size(); ++i){
+        int g = 0;
+        while (g < groups.size() &&
+               (groups[g][0]->depths() != filters[i]->depths() ||
+                groups[g][0]->rows() != filters[i]->rows() ||
+                groups[g][0]->cols() != filters[i]->cols())){
+            ++g;
+        }
+        if (g == groups.size()){
+            groups.push_back(vector<const Level *>());
+            indices.push_back(vector<int>());
+        }
+        groups[g].push_back(filters[i]);
+        indices[g].push_back(i);
+    }
+
+    for (int lvl = 0; lvl < levels_.size(); ++lvl){
+        const vector<Level> & boxes = levels_[lvl];
+        const int nbBoxes = boxes.size();
+
+        // The boxes of a level usually share their dimensions (topology_[lvl]). They are then
+        // scored by batches, each batch of boxes being a single matrix product, and only the
+        // batches are spread across the threads
+        vector<const Level *> boxPtrs(nbBoxes);
+        bool sameSize = true;
+
+        for (int box = 0; box < nbBoxes; ++box){
+            boxPtrs[box] = &boxes[box];
+            sameSize = sameSize && (boxes[box].depths() == boxes[0].depths()) &&
+                       (boxes[box].rows() == boxes[0].rows()) && (boxes[box].cols() == boxes[0].cols());
+        }
+
+        if (sameSize && (nbBoxes > 1)){
+            for (int g = 0; g < groups.size(); ++g){
+                const int nbPositions = max(boxes[0].depths() - groups[g][0]->depths() + 1, 0) *
+                                        max(boxes[0].rows() - groups[g][0]->rows() + 1, 0) *
+                                        max(boxes[0].cols() - groups[g][0]->cols() + 1, 0);
+
+                if (!nbPositions){
+                    continue;
+                }
+
+                // Single cells are one row each of a single product over the whole level
+                const bool cells = (boxes[0].size() == 1);
+
+                // A single small filter is a few dot products per position, the unrolled kernels
+                // skip the copy of the patches
+                if ((groups[g].size() == 1) && IsFixed(*groups[g][0]) && !cells){
+                    #pragma omp parallel for
+                    for (int box = 0; box < nbBoxes; ++box){
+                        Convolve(boxes[box], *groups[g][0], convolutions[indices[g][0]][lvl][box]);
+                    }
+
+                    continue;
+                }
+
+                const int patchBytes = nbPositions * groups[g][0]->size() * DescriptorSize * sizeof(Scalar);
+                const int batchSize = cells ? nbBoxes : max(1, BatchBytes / patchBytes);
+                const int nbBatches = (nbBoxes + batchSize - 1) / batchSize;
+
+                #pragma omp parallel
+                {
+                    Matrix patches;
+                    vector<Tensor3DF> results;
+
+                    #pragma omp for schedule(dynamic)
+                    for (int batch = 0; batch < nbBatches; ++batch){
+                        const int begin = batch * batchSize;
+                        const int end = min(begin + batchSize, nbBoxes);
+
+                        Convolve(&boxPtrs[begin], end - begin, groups[g], results, patches);
+
+                        for (int i = 0; i < groups[g].size() && !results.empty(); ++i){
+                            for (int box = begin; box < end; ++box){
+                                convolutions[indices[g][i]][lvl][box] =
+                                        std::move(results[i * (end - begin) + box - begin]);
+                            }
+                        }
+                    }
+                }
+            }
+
+            continue;
+        }
+
+        #pragma omp parallel for
+        for (int box = 0; box < nbBoxes; ++box){
+            for (int g = 0; g < groups.size(); ++g){
+                vector<Tensor3DF> results;
+                if (groups[g].size() == 1){
+                    results.resize(1);
+                    Convolve(boxes[box], *groups[g][0], results[0]);
+                }
+                else{
+                    Convolve(boxes[box], groups[g], results);
+                }
+
+                for (int i = 0; i < results.size(); ++i){
+                    convolutions[indices[g][i]][lvl][box] = results[i];
+                }
+            }
+        }
+    }
+}
+
+namespace
+{
+// Convolution with a filter of compile-time dimensions. The loops over the filter are unrolled and
+// each filter row (FC contiguous cells, facing FC contiguous cells of the level) is a single dot
+// product, without the im2col copy of the general case.
+template <int FD, int FR, int FC>
+struct FixedConvolution
+{
+    static void Convolve(const GSHOTPyramid::Level & level, const GSHOTPyramid::Level & filter,
+                         Tensor3DF & convolution)
+    {
+        const int depths = level.depths() - FD + 1;
+        const int rows = level.rows() - FR + 1;
+        const int cols = level.cols() - FC + 1;
+        const int rowSize = FC * GSHOTPyramid::DescriptorSize;
+        const int levelRow = level.cols() * GSHOTPyramid::DescriptorSize;
+        const int levelSlice = level.rows() * levelRow;
+
+        convolution = Tensor3DF(depths, rows, cols);
+
+        const Scalar * levelData = level.scalars();
+        const Scalar * filterData = filter.scalars();
+
+        for (int z = 0; z < depths; ++z){
+            for (int y = 0; y < rows; ++y){
+                for (int x = 0; x < cols; ++x){
+                    const Scalar * patch = levelData + z * levelSlice + y * levelRow +
+                            x * GSHOTPyramid::DescriptorSize;
+                    Scalar score = 0;
+
+                    for (int dz = 0; dz < FD; ++dz){
+                        for (int dy = 0; dy < FR; ++dy){
+                            score += CellKernels::Dot(patch + dz * levelSlice + dy * levelRow,
+                                                      filterData + (dz * FR + dy) * rowSize, rowSize);
+                        }
+                    }
+
+                    convolution()(z, y, x) = score;
+                }
+            }
+        }
+    }
+};
+
+// A 1x1x1 filter is a dot product per cell: a single matrix-vector product over the level
+template <>
+struct FixedConvolution<1, 1, 1>
+{
+    static void Convolve(const GSHOTPyramid::Level & level, const GSHOTPyramid::Level & filter,
+                         Tensor3DF & convolution)
+    {
+        convolution = Tensor3DF(level.depths(), level.rows(), level.cols());
+
+        Eigen::Map<Eigen::VectorXf>(convolution().data(), level.size()).noalias() =
+                Eigen::Map<const GSHOTPyramid::Matrix>(level.scalars(), level.size(),
+                                                       GSHOTPyramid::DescriptorSize) *
+                Eigen::Map<const Eigen::VectorXf>(filter.scalars(), GSHOTPyramid::DescriptorSize);
+    }
+};
+}
+
 void GSHOTPyramid::Convolve(const Level & level, const Level & filter, Tensor3DF & convolution)
 {
     // Nothing to do if x is smaller than y
-    if ((level().dimension(0) < filter().dimension(0)) || (level().dimension(1) < filter().dimension(1) )
-            || (level().dimension(2) < filter().dimension(2) )) {
+    if ((level.depths() < filter.depths()) || (level.rows() < filter.rows()) ||
+        (level.cols() < filter.cols()) || !filter.size()){
+        return;
+    }
+
+    if (IsCube<1>(filter)){
+        FixedConvolution<1, 1, 1>::Convolve(level, filter, convolution);
+        return;
+    }
+
+    if (IsCube<2>(filter)){
+        FixedConvolution<2, 2, 2>::Convolve(level, filter, convolution);
+        return;
+    }
+
+    if (IsCube<3>(filter)){
+        FixedConvolution<3, 3, 3>::Convolve(level, filter, convolution);
+        return;
+    }
+
+    vector<Tensor3DF> convolutions;
+
+    Convolve(level, vector<const Level *>(1, &filter), convolutions);
+
+    if (!convolutions.empty())
+        convolution = convolutions[0];
+}
+
+void GSHOTPyramid::Convolve(const Level & level, const vector<const Level *> & filters,
+                            vector<Tensor3DF> & convolutions)
+{
+    const Level * box = &level;
+    Matrix patches;
+
+    Convolve(&box, 1, filters, convolutions, patches);
+}
+
+void GSHOTPyramid::Convolve(const Level * const * boxes, int nbBoxes, const vector<const Level *> & filters,
+                            vector<Tensor3DF> & convolutions, Matrix & patches)
+{
+    convolutions.clear();
+
+    if (filters.empty() || (nbBoxes <= 0))
+        return;
+
+    const Level & level = *boxes[0];
+    const int fd = filters[0]->depths();
+    const int fr = filters[0]->rows();
+    const int fc = filters[0]->cols();
+
+    for (int i = 1; i < filters.size(); ++i){
+        if ((filters[i]->depths() != fd) || (filters[i]->rows() != fr) || (filters[i]->cols() != fc)){
+            cerr << "GSHOTPyramid::Convolve filters of different sizes" << endl;
+            return;
+        }
+    }
+
+    for (int b = 1; b < nbBoxes; ++b){
+        if ((boxes[b]->depths() != level.depths()) || (boxes[b]->rows() != level.rows()) ||
+            (boxes[b]->cols() != level.cols())){
+            cerr << "GSHOTPyramid::Convolve boxes of different sizes" << endl;
+            return;
+        }
+    }
+
+    // Nothing to do if x is smaller than y
+    if ((level.depths() < fd) || (level.rows() < fr) || (level.cols() < fc) || !fd || !fr || !fc){
 //        cout<<"GSHOTPyramid::convolve error : level size is smaller than filter" << endl;
-//        cout<<"GSHOTPyramid::convolve error : " <<level().dimension(0)<<" < "<<filter().dimension(0)
-//           <<" / " << level().dimension(1)<<" < "<<filter().dimension(1)
-//          <<" / " << level().dimension(2)<<" < "<<filter().dimension(2)<< endl;
         return;
     }
 
+    const int depths = level.depths() - fd + 1;
+    const int rows = level.rows() - fr + 1;
+    const int cols = level.cols() - fc + 1;
+    const int nbPositions = depths * rows * cols;
+    const int patchSize = fd * fr * fc * DescriptorSize;
+    const int nbFilters = filters.size();
+
+    // One column per flattened filter
+    Eigen::MatrixXf filterMat(patchSize, nbFilters);
+    for (int i = 0; i < nbFilters; ++i){
+        filterMat.col(i) = Eigen::Map<const Eigen::VectorXf>(
+                    reinterpret_cast<const Scalar *>((*filters[i])().data()), patchSize);
+    }
+
+    // One row per output position of each box ([box][z][y][x][feature]). A 1x1x1 filter on a
+    // single box sees the level itself, no copy needed
+    const bool unit = (fd == 1) && (fr == 1) && (fc == 1);
+
+    if (!unit || (nbBoxes > 1)){
+        patches.resize(nbBoxes * nbPositions, patchSize);
+        const int rowSize = fc * DescriptorSize;
+
+        for (int b = 0; b < nbBoxes; ++b){
+            const Scalar * levelData = boxes[b]->scalars();
+
+            for (int z = 0; z < depths; ++z){
+                for (int y = 0; y < rows; ++y){
+                    for (int x = 0; x < cols; ++x){
+                        Scalar * patch = patches.row(b * nbPositions + (z * rows + y) * cols + x).data();
+                        for (int dz = 0; dz < fd; ++dz){
+                            for (int dy = 0; dy < fr; ++dy){
+                                const Scalar * src = levelData +
+                                        (((z + dz) * level.rows() + y + dy) * level.cols() + x) * DescriptorSize;
+                                std::copy(src, src + rowSize, patch + (dz * fr + dy) * rowSize);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    const Eigen::Map<const Matrix> patchesMap((unit && (nbBoxes == 1)) ? level.scalars() : patches.data(),
+                                              nbBoxes * nbPositions, patchSize);
+
+    // Convolution of filter i with box b at i * nbBoxes + b
+    convolutions.resize(nbFilters * nbBoxes);
 
-    convolution = level.convolve(filter);
+    if (nbFilters == 1){
+        Eigen::VectorXf results(nbBoxes * nbPositions);
+        results.noalias() = patchesMap * filterMat.col(0);
+
+        for (int b = 0; b < nbBoxes; ++b){
+            convolutions[b] = Tensor3DF(depths, rows, cols);
+            Eigen::Map<Eigen::VectorXf>(convolutions[b]().data(), nbPositions) =
+                    results.segment(b * nbPositions, nbPositions);
+        }
+        return;
+    }
+
+    const Eigen::MatrixXf results = patchesMap * filterMat;
+
+    for (int i = 0; i < nbFilters; ++i){
+        for (int b = 0; b < nbBoxes; ++b){
+            convolutions[i * nbBoxes + b] = Tensor3DF(depths, rows, cols);
+            Eigen::Map<Eigen::VectorXf>(convolutions[i * nbBoxes + b]().data(), nbPositions) =
+                    results.col(i).segment(b * nbPositions, nbPositions);
+        }
+    }
 
 //    convolution = level.khi2Convolve(filter);
 
@@ -767,58 +1102,169 @@ GSHOTPyramid::computeKeyptsWithThresh(PointCloudPtr cloud, float grid_reso, Poin
     keypoints->height   = 1;
     keypoints->points.resize(keypoints->width);
 
+    if (pt_nb_x <= 0 || pt_nb_y <= 0 || pt_nb_z <= 0)
+        return keypoints;
+
+    // Voxel occupancy histogram of the cloud, padded with a zero border at the front so that it
+    // can be turned in place into a 3D summed-area table
+    const int gx = pt_nb_x + filterSizes(2) + 1;
+    const int gy = pt_nb_y + filterSizes(1) + 1;
+    const int gz = pt_nb_z + filterSizes(0) + 1;
+    vector<int> integral(static_cast<size_t>(gx) * gy * gz, 0);
+
+    const int nbPoints = static_cast<int>(cloud->size());
+
+    #pragma omp parallel for
+    for(int i=0;i<nbPoints;++i){
+        const PointType & pt = cloud->points[i];
+        if (!pcl_isfinite(pt.x) || !pcl_isfinite(pt.y) || !pcl_isfinite(pt.z))
+            continue;
+        int x = floor((pt.x - min.x) / grid_reso) + 1;
+        int y = floor((pt.y - min.y) / grid_reso) + 1;
+        int z = floor((pt.z - min.z) / grid_reso) + 1;
+        if (x < 1 || y < 1 || z < 1 || x >= gx || y >= gy || z >= gz)
+            continue;
+        #pragma omp atomic
+        ++integral[(static_cast<size_t>(z) * gy + y) * gx + x];
+    }
+
+    // Prefix sums along x, then y, then z
+    #pragma omp parallel for
+    for(int z=1;z<gz;++z){
+        for(int y=1;y<gy;++y){
+            int * line = &integral[(static_cast<size_t>(z) * gy + y) * gx];
+            for(int x=1;x<gx;++x){
+                line[x] += line[x-1];
+            }
+        }
+    }
+    #pragma omp parallel for
+    for(int z=1;z<gz;++z){
+        for(int y=1;y<gy;++y){
+            int * line = &integral[(static_cast<size_t>(z) * gy + y) * gx];
+            const int * prev = line - gx;
+            for(int x=1;x<gx;++x){
+                line[x] += prev[x];
+            }
+        }
+    }
+    #pragma omp parallel for
+    for(int y=1;y<gy;++y){
+        for(int z=1;z<gz;++z){
+            int * line = &integral[(static_cast<size_t>(z) * gy + y) * gx];
+            const int * prev = line - static_cast<size_t>(gy) * gx;
+            for(int x=1;x<gx;++x){
+                line[x] += prev[x];
+            }
+        }
+    }
+
+    // Number of points of each candidate box in O(1)
+    const size_t dx = filterSizes(2);
+    const size_t dy = static_cast<size_t>(filterSizes(1)) * gx;
+    const size_t dz = static_cast<size_t>(filterSizes(0)) * gy * gx;
+    vector<char> dense(static_cast<size_t>(pt_nb_x) * pt_nb_y * pt_nb_z, 0);
 
+    #pragma omp parallel for
     for(int z=0;z<pt_nb_z;++z){
         for(int y=0;y<pt_nb_y;++y){
             for(int x=0;x<pt_nb_x;++x){
-                //put keyPts in the middle of the box
-                PointType p = PointType();
-                p.x = min.x + (x+filterSizes(2)/2.0)*grid_reso;
-                p.y = min.y + (y+filterSizes(1)/2.0)*grid_reso;
-                p.z = min.z + (z+filterSizes(0)/2.0)*grid_reso;
-
-                Vector4f ptStart( min.x + x*grid_reso,
-                                  min.y + y*grid_reso,
-                                  min.z + z*grid_reso, 1);
-                Vector4f ptEnd( ptStart(0) + filterSizes(2)*grid_reso,
-                                ptStart(1) + filterSizes(1)*grid_reso,
-                                ptStart(2) + filterSizes(0)*grid_reso, 1);
-                std::vector<int> pt_indices;
-                pcl::getPointsInBox(*cloud, ptStart, ptEnd, pt_indices);
+                const int * c = &integral[(static_cast<size_t>(z) * gy + y) * gx + x];
+                int nbPts = c[dz + dy + dx] - c[dz + dy] - c[dz + dx] - c[dy + dx]
+                          + c[dz] + c[dy] + c[dx] - c[0];
 
                 // Discarding regions without enough points
-                if(pt_indices.size()>=thresh){
-                    keypoints->width    = keypoints->points.size()+1;
-                    keypoints->height   = 1;
-                    keypoints->points.resize (keypoints->width);
-                    keypoints->at(keypoints->points.size()-1) = p;
+                dense[(static_cast<size_t>(z) * pt_nb_y + y) * pt_nb_x + x] = nbPts >= thresh;
+            }
+        }
+    }
+
+    for(int z=0;z<pt_nb_z;++z){
+        for(int y=0;y<pt_nb_y;++y){
+            for(int x=0;x<pt_nb_x;++x){
+                if(dense[(static_cast<size_t>(z) * pt_nb_y + y) * pt_nb_x + x]){
+                    //put keyPts in the middle of the box
+                    PointType p = PointType();
+                    p.x = min.x + (x+filterSizes(2)/2.0)*grid_reso;
+                    p.y = min.y + (y+filterSizes(1)/2.0)*grid_reso;
+                    p.z = min.z + (z+filterSizes(0)/2.0)*grid_reso;
+                    keypoints->points.push_back(p);
                 }
             }
         }
     }
+    keypoints->width    = keypoints->points.size();
+    keypoints->height   = 1;
     
     return keypoints;
 }
 
 
-DescriptorsPtr
-GSHOTPyramid::compute_descriptor(PointCloudPtr input, PointCloudPtr keypoints, float descr_rad)
+void GSHOTPyramid::setSearchSurface(PointCloudPtr surface)
 {
-    DescriptorsPtr descriptors (new Descriptors());
-    SurfaceNormalsPtr normals (new SurfaceNormals());
+    surface_ = surface;
+    surfaceNormals_.reset(new SurfaceNormals());
+    surfaceTree_.reset(new pcl::search::KdTree<PointType>());
+    surfaceTree_->setInputCloud(surface_);
 
-    pcl::NormalEstimation<PointType,NormalType> norm_est;
+    pcl::NormalEstimationOMP<PointType,NormalType> norm_est;
     norm_est.setKSearch (8);
-    norm_est.setInputCloud (input);
-    norm_est.compute (*normals);
+    norm_est.setSearchMethod (surfaceTree_);
+    norm_est.setInputCloud (surface_);
+    norm_est.compute (*surfaceNormals_);
+}
+
+SurfaceNormalsConstPtr GSHOTPyramid::surfaceNormals() const
+{
+    return surfaceNormals_;
+}
+
+DescriptorsPtr
+GSHOTPyramid::compute_descriptor(PointCloudPtr input, PointCloudPtr keypoints, float descr_rad,
+                                 bool parallel)
+{
+    DescriptorsPtr descriptors (new Descriptors());
+    SurfaceNormalsPtr normals = surfaceNormals_;
+    pcl::search::KdTree<PointType>::Ptr tree = surfaceTree_;
+
+    // Fall back to a local computation for any other surface than the scene one
+    if (input != surface_ || !normals || !tree){
+        normals.reset(new SurfaceNormals());
+        tree.reset(new pcl::search::KdTree<PointType>());
+        tree->setInputCloud (input);
+
+        pcl::NormalEstimation<PointType,NormalType> norm_est;
+        norm_est.setKSearch (8);
+        norm_est.setSearchMethod (tree);
+        norm_est.setInputCloud (input);
+        norm_est.compute (*normals);
+    }
 //        cout<<"GSHOT:: keypoints size = "<<keypoints->size()<<endl;
 
+    // The reference frames are computed with the shared tree as well, otherwise SHOTEstimation
+    // builds its own tree over the surface at every call
+    PointCloudRFPtr frames (new PointCloudRF());
+    pcl::SHOTLocalReferenceFrameEstimation<PointType, RFType> lrf_est;
+    pcl::SHOTLocalReferenceFrameEstimationOMP<PointType, RFType> lrf_est_omp;
+    pcl::SHOTLocalReferenceFrameEstimation<PointType, RFType> & lrf =
+            parallel ? lrf_est_omp : lrf_est;
+    lrf.setRadiusSearch (descr_rad);
+    lrf.setInputCloud (keypoints);
+    lrf.setSearchSurface (input);
+    lrf.setSearchMethod (tree);
+    lrf.compute (*frames);
+
     pcl::SHOTEstimation<PointType, NormalType, DescriptorType> descr_est;
-    descr_est.setRadiusSearch (descr_rad);
-    descr_est.setInputCloud (keypoints);
-    descr_est.setInputNormals (normals);
-    descr_est.setSearchSurface (input);
-    descr_est.compute (*descriptors);
+    pcl::SHOTEstimationOMP<PointType, NormalType, DescriptorType> descr_est_omp;
+    pcl::SHOTEstimation<PointType, NormalType, DescriptorType> & descr =
+            parallel ? descr_est_omp : descr_est;
+    descr.setRadiusSearch (descr_rad);
+    descr.setInputCloud (keypoints);
+    descr.setInputNormals (normals);
+    descr.setSearchSurface (input);
+    descr.setSearchMethod (tree);
+    descr.setInputReferenceFrames (frames);
+    descr.compute (*descriptors);
 
 //    cout<<"GSHOT:: descriptors size = "<<descriptors->size()<<endl;
 
@@ -837,6 +1283,42 @@ GSHOTPyramid::compute_descriptor(PointCloudPtr input, PointCloudPtr keypoints, f
     return descriptors;
 }
 
+void GSHOTPyramid::computeBoxesDescriptors(PointCloudPtr input, int lvl, float descr_rad)
+{
+    const int nbBoxes = static_cast<int>(keyPts_[lvl].size());
+    const int nbKeyPts = topology_[lvl](0) * topology_[lvl](1) * topology_[lvl](2);
+
+    if (!nbBoxes || !nbKeyPts)
+        return;
+
+    // Join the keypoints of every box in a single cloud, box after box
+    PointCloudPtr keypoints (new PointCloudT(nbBoxes * nbKeyPts, 1, PointType()));
+
+    #pragma omp parallel for
+    for (int box = 0; box < nbBoxes; ++box){
+        std::copy(keyPts_[lvl][box]->points.begin(), keyPts_[lvl][box]->points.end(),
+                  keypoints->points.begin() + box * nbKeyPts);
+    }
+
+    DescriptorsPtr descriptors = compute_descriptor(input, keypoints, descr_rad, true);
+
+    // Scatter the descriptors back to their box
+    #pragma omp parallel for
+    for (int box = 0; box < nbBoxes; ++box){
+        Level level( topology_[lvl](0), topology_[lvl](1), topology_[lvl](2));
+        int kpt = box * nbKeyPts;
+        for (int z = 0; z < level.depths(); ++z){
+            for (int y = 0; y < level.rows(); ++y){
+                for (int x = 0; x < level.cols(); ++x){
+                    level()(z, y, x) = Eigen::Map<const Cell>(descriptors->points[kpt].descriptor);
+                    ++kpt;
+                }
+            }
+        }
+        levels_[lvl][box] = level;
+    }
+}
+
 double GSHOTPyramid::computeCloudResolution (PointCloudConstPtr cloud)
 {
   double res = 0.0;
@@ -895,11 +1377,612 @@ const vector<vector<GSHOTPyramid::Level> > & GSHOTPyramid::levels() const{
     return levels_;
 }
 
+const vector<vector<Tensor3DF> > & GSHOTPyramid::squaredNorms() const{
+    return squaredNorms_;
+}
+
+void GSHOTPyramid::computeSquaredNorms(){
+    squaredNorms_.resize(levels_.size());
+
+    for (int lvl = 0; lvl < levels_.size(); ++lvl){
+        squaredNorms_[lvl].resize(levels_[lvl].size());
+
+        #pragma omp parallel for
+        for (int box = 0; box < levels_[lvl].size(); ++box){
+            squaredNorms_[lvl][box] = levels_[lvl][box].cellSquaredNorms();
+        }
+    }
+}
+
 const vector<float> & GSHOTPyramid::resolutions() const{
 
     return resolutions_;
 }
 
+namespace
+{
+// Layout of the binary pyramid format (native endianness):
+//   header     magic, version, descriptor size, interval, nbOctave, nbParts, filterSizes,
+//              sceneOffset, resolutions and topologies
+//   levels     for each level its number of boxes, then for each box its dimensions, its cells
+//              (aligned on BinaryAlignment bytes from the start), its keypoints and its rectangle
+//   global     globalKeyPts and globalDescriptors
+const char BinaryMagic[8] = {'G', 'S', 'H', 'O', 'T', 'P', 'Y', 'R'};
+const size_t BinaryAlignment = 64;
+
+class BinaryWriter
+{
+public:
+    BinaryWriter(ostream & os) : os_(os), offset_(0)
+    {
+    }
+
+    void write(const void * data, size_t size)
+    {
+        os_.write(static_cast<const char *>(data), size);
+        offset_ += size;
+    }
+
+    template <typename T>
+    void write(const T & value)
+    {
+        write(&value, sizeof(T));
+    }
+
+    void align()
+    {
+        static const char zeros[BinaryAlignment] = {};
+        write(zeros, (BinaryAlignment - offset_ % BinaryAlignment) % BinaryAlignment);
+    }
+
+private:
+    ostream & os_;
+    size_t offset_;
+};
+
+class BinaryReader
+{
+public:
+    BinaryReader(const char * data, size_t size) : data_(data), size_(size), offset_(0)
+    {
+    }
+
+    // Returns the address of the next size bytes, or 0 if the buffer is too short
+    const char * read(size_t size)
+    {
+        if (size > size_ - offset_) {
+            offset_ = size_;
+            return 0;
+        }
+        const char * data = data_ + offset_;
+        offset_ += size;
+        return data;
+    }
+
+    template <typename T>
+    bool read(T & value)
+    {
+        const char * data = read(sizeof(T));
+        if (!data)
+            return false;
+        memcpy(&value, data, sizeof(T));
+        return true;
+    }
+
+    bool align()
+    {
+        return read((BinaryAlignment - offset_ % BinaryAlignment) % BinaryAlignment) != 0;
+    }
+
+private:
+    const char * data_;
+    size_t size_;
+    size_t offset_;
+};
+
+void writeVector3i(BinaryWriter & writer, const Vector3i & v)
+{
+    const int values[3] = {v(0), v(1), v(2)};
+    writer.write(values, sizeof(values));
+}
+
+bool readVector3i(BinaryReader & reader, Vector3i & v)
+{
+    int values[3];
+    if (!reader.read(values))
+        return false;
+    v = Vector3i(values[0], values[1], values[2]);
+    return true;
+}
+
+void writeCloud(BinaryWriter & writer, const PointCloudPtr & cloud)
+{
+    const int size = cloud ? static_cast<int>(cloud->size()) : 0;
+    writer.write(size);
+    for (int i = 0; i < size; ++i) {
+        const PointType & p = cloud->points[i];
+        const float xyzrgb[4] = {p.x, p.y, p.z, p.rgb};
+        writer.write(xyzrgb, sizeof(xyzrgb));
+    }
+}
+
+bool readCloud(BinaryReader & reader, PointCloudPtr & cloud)
+{
+    int size;
+    if (!reader.read(size) || size < 0)
+        return false;
+    const char * data = reader.read(static_cast<size_t>(size) * 4 * sizeof(float));
+    if (!data)
+        return false;
+    cloud.reset(new PointCloudT(size, 1, PointType()));
+    for (int i = 0; i < size; ++i) {
+        float xyzrgb[4];
+        memcpy(xyzrgb, data + i * sizeof(xyzrgb), sizeof(xyzrgb));
+        PointType & p = cloud->points[i];
+        p.x = xyzrgb[0];
+        p.y = xyzrgb[1];
+        p.z = xyzrgb[2];
+        p.rgb = xyzrgb[3];
+    }
+    return true;
+}
+
+void writeRectangle(BinaryWriter & writer, const Rectangle & rect)
+{
+    const Vector3f origin = rect.origin();
+    const Vector3f size = rect.size();
+    const Matrix4f tform = rect.transform();
+    writer.write(origin.data(), 3 * sizeof(float));
+    writer.write(size.data(), 3 * sizeof(float));
+    writer.write(tform.data(), 16 * sizeof(float));
+}
+
+bool readRectangle(BinaryReader & reader, Rectangle & rect)
+{
+    Vector3f origin, size;
+    Matrix4f tform;
+    const char * data = reader.read(22 * sizeof(float));
+    if (!data)
+        return false;
+    memcpy(origin.data(), data, 3 * sizeof(float));
+    memcpy(size.data(), data + 3 * sizeof(float), 3 * sizeof(float));
+    memcpy(tform.data(), data + 6 * sizeof(float), 16 * sizeof(float));
+    rect = Rectangle(origin, size, tform);
+    return true;
+}
+
+void writeLevel(BinaryWriter & writer, const GSHOTPyramid::Level & level)
+{
+    writeVector3i(writer, Vector3i(level.depths(), level.rows(), level.cols()));
+    writer.align();
+    writer.write(level().data(), level().size() * sizeof(GSHOTPyramid::Cell));
+}
+
+bool readLevel(BinaryReader & reader, GSHOTPyramid::Level & level)
+{
+    Vector3i dims;
+    if (!readVector3i(reader, dims) || (dims.array() < 0).any() || !reader.align())
+        return false;
+    const size_t size = static_cast<size_t>(dims(0)) * dims(1) * dims(2);
+    const char * data = reader.read(size * sizeof(GSHOTPyramid::Cell));
+    if (!data)
+        return false;
+    level = GSHOTPyramid::Level(dims(0), dims(1), dims(2));
+    memcpy(level().data(), data, size * sizeof(GSHOTPyramid::Cell));
+    return true;
+}
+
+void writeDescriptors(BinaryWriter & writer, const DescriptorsPtr & descriptors)
+{
+    const int size = descriptors ? static_cast<int>(descriptors->size()) : 0;
+    writer.write(size);
+    for (int i = 0; i < size; ++i) {
+        writer.write(descriptors->points[i].descriptor, GSHOTPyramid::DescriptorSize * sizeof(float));
+        writer.write(descriptors->points[i].rf, 9 * sizeof(float));
+    }
+}
+
+bool readDescriptors(BinaryReader & reader, DescriptorsPtr & descriptors)
+{
+    const size_t descSize = (GSHOTPyramid::DescriptorSize + 9) * sizeof(float);
+    int size;
+    if (!reader.read(size) || size < 0)
+        return false;
+    const char * data = reader.read(static_cast<size_t>(size) * descSize);
+    if (!data)
+        return false;
+    descriptors.reset(new Descriptors());
+    descriptors->resize(size);
+    for (int i = 0; i < size; ++i) {
+        memcpy(descriptors->points[i].descriptor, data + i * descSize,
+               GSHOTPyramid::DescriptorSize * sizeof(float));
+        memcpy(descriptors->points[i].rf, data + i * descSize + GSHOTPyramid::DescriptorSize * sizeof(float),
+               9 * sizeof(float));
+    }
+    return true;
+}
+
+void writePyramid(ostream & os, const GSHOTPyramid & pyramid)
+{
+    BinaryWriter writer(os);
+    writer.write(BinaryMagic, sizeof(BinaryMagic));
+    writer.write(GSHOTPyramid::BinaryVersion);
+    writer.write(GSHOTPyramid::DescriptorSize);
+    writer.write(pyramid.interval_);
+    writer.write(pyramid.nbOctave_);
+    writer.write(pyramid.nbParts_);
+    writeVector3i(writer, pyramid.filterSizes_);
+    writeVector3i(writer, pyramid.sceneOffset_);
+
+    writer.write(static_cast<int>(pyramid.resolutions_.size()));
+    writer.write(pyramid.resolutions_.data(), pyramid.resolutions_.size() * sizeof(float));
+    writer.write(static_cast<int>(pyramid.topology_.size()));
+    for (int i = 0; i < pyramid.topology_.size(); ++i)
+        writeVector3i(writer, pyramid.topology_[i]);
+
+    writer.write(static_cast<int>(pyramid.levels_.size()));
+    for (int lvl = 0; lvl < pyramid.levels_.size(); ++lvl) {
+        const int nbBoxes = pyramid.levels_[lvl].size();
+        writer.write(nbBoxes);
+        for (int box = 0; box < nbBoxes; ++box) {
+            writeLevel(writer, pyramid.levels_[lvl][box]);
+            writeCloud(writer, (lvl < pyramid.keyPts_.size() && box < pyramid.keyPts_[lvl].size()) ?
+                                   pyramid.keyPts_[lvl][box] : PointCloudPtr());
+            writeRectangle(writer, (lvl < pyramid.rectangles_.size() && box < pyramid.rectangles_[lvl].size()) ?
+                                       pyramid.rectangles_[lvl][box] : Rectangle());
+        }
+    }
+
+    writeCloud(writer, pyramid.globalKeyPts);
+    writeDescriptors(writer, pyramid.globalDescriptors);
+}
+
+// Reads a pyramid written by writePyramid, leaves the pyramid unmodified on failure. If
+// sameStructure is set, also fails if the interval or number of octaves of the file differ from
+// those of the pyramid
+bool readPyramid(const char * data, size_t size, GSHOTPyramid & pyramid, bool sameStructure = false)
+{
+    BinaryReader reader(data, size);
+
+    const char * magic = reader.read(sizeof(BinaryMagic));
+    int version, descriptorSize;
+    if (!magic || memcmp(magic, BinaryMagic, sizeof(BinaryMagic)) || !reader.read(version) ||
+        !reader.read(descriptorSize)) {
+        cerr << "Invalid pyramid file" << endl;
+        return false;
+    }
+    if (version != GSHOTPyramid::BinaryVersion || descriptorSize != GSHOTPyramid::DescriptorSize) {
+        cerr << "Incompatible pyramid file version " << version << endl;
+        return false;
+    }
+
+    int interval, nbOctave, nbParts;
+    Vector3i filterSizes, sceneOffset;
+    vector<float> resolutions;
+    std::vector<Eigen::Vector3i, Eigen::aligned_allocator<Eigen::Vector3i> > topology;
+    vector<vector<GSHOTPyramid::Level> > levels;
+    vector<vector<PointCloudPtr> > keyPts;
+    vector<vector<Rectangle> > rectangles;
+    PointCloudPtr globalKeyPts;
+    DescriptorsPtr globalDescriptors;
+    int nb;
+
+    bool valid = reader.read(interval) && reader.read(nbOctave) && reader.read(nbParts) &&
+                 readVector3i(reader, filterSizes) && readVector3i(reader, sceneOffset) &&
+                 reader.read(nb) && nb >= 0;
+
+    if (valid && sameStructure &&
+        ((interval != pyramid.interval_) || (nbOctave != pyramid.nbOctave_))) {
+        cerr << "The pyramid file has " << interval << " levels per octave and " << nbOctave
+             << " octaves instead of " << pyramid.interval_ << " and " << pyramid.nbOctave_ << endl;
+        return false;
+    }
+
+    if (valid) {
+        const char * res = reader.read(static_cast<size_t>(nb) * sizeof(float));
+        valid = res != 0;
+        if (valid) {
+            resolutions.resize(nb);
+            memcpy(resolutions.data(), res, nb * sizeof(float));
+        }
+    }
+
+    valid = valid && reader.read(nb) && nb >= 0;
+    if (valid)
+        topology.resize(nb);
+    for (int i = 0; valid && i < topology.size(); ++i)
+        valid = readVector3i(reader, topology[i]);
+
+    valid = valid && reader.read(nb) && nb >= 0;
+    if (valid) {
+        levels.resize(nb);
+        keyPts.resize(nb);
+        rectangles.resize(nb);
+    }
+    for (int lvl = 0; valid && lvl < levels.size(); ++lvl) {
+        valid = reader.read(nb) && nb >= 0;
+        if (!valid)
+            break;
+        levels[lvl].resize(nb);
+        keyPts[lvl].resize(nb);
+        rectangles[lvl].resize(nb);
+        for (int box = 0; valid && box < nb; ++box)
+            valid = readLevel(reader, levels[lvl][box]) && readCloud(reader, keyPts[lvl][box]) &&
+                    readRectangle(reader, rectangles[lvl][box]);
+    }
+
+    valid = valid && readCloud(reader, globalKeyPts) && readDescriptors(reader, globalDescriptors);
+
+    if (!valid) {
+        cerr << "Truncated pyramid file" << endl;
+        return false;
+    }
+
+    pyramid.interval_ = interval;
+    pyramid.nbOctave_ = nbOctave;
+    pyramid.nbParts_ = nbParts;
+    pyramid.filterSizes_ = filterSizes;
+    pyramid.sceneOffset_ = sceneOffset;
+    pyramid.resolutions_.swap(resolutions);
+    pyramid.topology_.swap(topology);
+    pyramid.levels_.swap(levels);
+    pyramid.keyPts_.swap(keyPts);
+    pyramid.rectangles_.swap(rectangles);
+    pyramid.globalKeyPts = globalKeyPts;
+    pyramid.globalDescriptors = globalDescriptors;
+    pyramid.computeSquaredNorms();
+
+    return true;
+}
+
+// 64-bit FNV-1a hash
+const uint64_t FnvOffset = 14695981039346656037ULL;
+
+uint64_t fnv1a(const void * data, size_t size, uint64_t hash = FnvOffset)
+{
+    const unsigned char * bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Hash of the content of a file (0 if it cannot be read), remembered as long as the file keeps
+// the same size and modification time
+uint64_t fileHash(const string & filename)
+{
+    typedef std::pair<uintmax_t, std::time_t> Stamp;
+    static std::map<string, std::pair<Stamp, uint64_t> > hashes;
+
+    boost::system::error_code error;
+    const uintmax_t size = boost::filesystem::file_size(filename, error);
+    if (error || !size)
+        return 0;
+    const std::time_t time = boost::filesystem::last_write_time(filename, error);
+    if (error)
+        return 0;
+    const Stamp stamp(size, time);
+
+    uint64_t hash = 0;
+    #pragma omp critical(GSHOTPyramidFileHash)
+    {
+        std::map<string, std::pair<Stamp, uint64_t> >::const_iterator it = hashes.find(filename);
+        if (it != hashes.end() && it->second.first == stamp)
+            hash = it->second.second;
+    }
+    if (hash)
+        return hash;
+
+    try {
+        boost::interprocess::file_mapping file(filename.c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+        hash = fnv1a(region.get_address(), region.get_size());
+    }
+    catch (const boost::interprocess::interprocess_exception &) {
+        return 0;
+    }
+
+    #pragma omp critical(GSHOTPyramidFileHash)
+    hashes[filename] = std::make_pair(stamp, hash);
+
+    return hash;
+}
+
+string cacheDirectory;
+}
+
+bool GSHOTPyramid::save(const string & filename) const
+{
+    // Write to a temporary file first so that a concurrent load() never sees a partial pyramid
+    const string tmpFilename = filename + ".tmp";
+    {
+        ofstream out(tmpFilename.c_str(), ios::binary);
+        out << *this;
+        if (!out) {
+            cerr << "Could not write the pyramid file " << filename << endl;
+            return false;
+        }
+    }
+
+    boost::system::error_code error;
+    boost::filesystem::rename(tmpFilename, filename, error);
+    if (error) {
+        cerr << "Could not write the pyramid file " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+bool GSHOTPyramid::load(const string & filename)
+{
+    boost::system::error_code error;
+    if (!boost::filesystem::exists(filename, error))
+        return false;
+
+    try {
+        boost::interprocess::file_mapping file(filename.c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+        return readPyramid(static_cast<const char *>(region.get_address()), region.get_size(), *this,
+                           true);
+    }
+    catch (const boost::interprocess::interprocess_exception &) {
+        cerr << "Could not map the pyramid file " << filename << endl;
+        return false;
+    }
+}
+
+void GSHOTPyramid::filterBoxes(const Level & rootFilter, float accuracyThreshold)
+{
+    if (!globalDescriptors || levels_.size() < 2)
+        return;
+
+    int cpt0 = 0;
+    for(int i=0;i<globalDescriptors->size();++i){
+        if(CellKernels::Dot(rootFilter()(0,0,0).data(), globalDescriptors->points[i].descriptor,
+                            DescriptorSize) >= accuracyThreshold){
+            for(int lvl=0;lvl<levels_.size();++lvl){
+                levels_[lvl][cpt0] = levels_[lvl][i];
+                keyPts_[lvl][cpt0] = keyPts_[lvl][i];
+                rectangles_[lvl][cpt0] = rectangles_[lvl][i];
+            }
+            globalKeyPts->points[cpt0] = globalKeyPts->points[i];
+            globalDescriptors->points[cpt0] = globalDescriptors->points[i];
+            ++cpt0;
+        }
+    }
+
+    for(int lvl=0;lvl<levels_.size();++lvl){
+        levels_[lvl].resize(cpt0);
+        keyPts_[lvl].resize(cpt0);
+        rectangles_[lvl].resize(cpt0);
+    }
+    globalKeyPts->resize(cpt0);
+    globalDescriptors->resize(cpt0);
+    computeSquaredNorms();
+}
+
+void GSHOTPyramid::filterBoxes(const GSHOTPyramid & pyramid, const Level & rootFilter,
+                               float accuracyThreshold)
+{
+    if (!pyramid.globalDescriptors || pyramid.levels_.size() < 2){
+        *this = pyramid;
+        return;
+    }
+
+    // Boxes kept from the full pyramid
+    vector<int> kept;
+    for(int i=0;i<static_cast<int>(pyramid.globalDescriptors->size());++i){
+        if(CellKernels::Dot(rootFilter()(0,0,0).data(), pyramid.globalDescriptors->points[i].descriptor,
+                            DescriptorSize) >= accuracyThreshold){
+            kept.push_back(i);
+        }
+    }
+
+    const int nbLevels = pyramid.levels_.size();
+    const int nbKept = kept.size();
+
+    pad_ = pyramid.pad_;
+    interval_ = pyramid.interval_;
+    nbOctave_ = pyramid.nbOctave_;
+    nbParts_ = pyramid.nbParts_;
+    resolutions_ = pyramid.resolutions_;
+    topology_ = pyramid.topology_;
+    filterSizes_ = pyramid.filterSizes_;
+    sceneOffset_ = pyramid.sceneOffset_;
+    surface_ = pyramid.surface_;
+    surfaceNormals_ = pyramid.surfaceNormals_;
+    surfaceTree_ = pyramid.surfaceTree_;
+
+    levels_.assign(nbLevels, vector<Level>(nbKept));
+    squaredNorms_.assign(nbLevels, vector<Tensor3DF>(nbKept));
+    keyPts_.assign(nbLevels, vector<PointCloudPtr>(nbKept));
+    rectangles_.assign(nbLevels, vector<Rectangle>(nbKept));
+
+    // The global clouds are shared with the full pyramid, the kept points go to new ones
+    globalKeyPts.reset(new PointCloudT(nbKept, 1, PointType()));
+    globalDescriptors.reset(new Descriptors(nbKept, 1, DescriptorType()));
+
+    for(int lvl=0;lvl<nbLevels;++lvl){
+        // The norms are recomputed if the full pyramid has none
+        const bool norms = (lvl < static_cast<int>(pyramid.squaredNorms_.size())) &&
+                           (pyramid.squaredNorms_[lvl].size() == pyramid.levels_[lvl].size());
+
+        #pragma omp parallel for
+        for(int box=0;box<nbKept;++box){
+            levels_[lvl][box] = pyramid.levels_[lvl][kept[box]];
+            keyPts_[lvl][box] = pyramid.keyPts_[lvl][kept[box]];
+            rectangles_[lvl][box] = pyramid.rectangles_[lvl][kept[box]];
+            squaredNorms_[lvl][box] = norms ? pyramid.squaredNorms_[lvl][kept[box]] :
+                                              levels_[lvl][box].cellSquaredNorms();
+        }
+    }
+
+    for(int box=0;box<nbKept;++box){
+        globalKeyPts->points[box] = pyramid.globalKeyPts->points[kept[box]];
+        globalDescriptors->points[box] = pyramid.globalDescriptors->points[kept[box]];
+    }
+}
+
+void GSHOTPyramid::SetCacheDirectory(const string & directory)
+{
+    cacheDirectory = directory;
+    if (cacheDirectory.empty())
+        return;
+
+    boost::system::error_code error;
+    boost::filesystem::create_directories(cacheDirectory, error);
+    if (error) {
+        cerr << "Could not create the pyramid cache directory " << directory << endl;
+        cacheDirectory.clear();
+    }
+}
+
+const string & GSHOTPyramid::CacheDirectory()
+{
+    return cacheDirectory;
+}
+
+string GSHOTPyramid::CachePath(const string & filename, float resolution, Vector3i filterSizes,
+                               int nbParts, int interval, int nbOctave, int densityThreshold,
+                               const string & variant)
+{
+    if (cacheDirectory.empty())
+        return string();
+
+    uint64_t hash = fileHash(filename);
+    if (!hash)
+        return string();
+
+    const int params[7] = {filterSizes(0), filterSizes(1), filterSizes(2), nbParts, interval, nbOctave,
+                           densityThreshold};
+    hash = fnv1a(&resolution, sizeof(resolution), hash);
+    hash = fnv1a(params, sizeof(params), hash);
+    hash = fnv1a(variant.data(), variant.size(), hash);
+
+    ostringstream name;
+    name << boost::filesystem::path(filename).stem().string() << '_'
+         << hex << setw(16) << setfill('0') << hash << ".pyr";
+
+    return (boost::filesystem::path(cacheDirectory) / name.str()).string();
+}
+
+ostream & FFLD::operator<<(ostream & os, const GSHOTPyramid & pyramid)
+{
+    writePyramid(os, pyramid);
+    return os;
+}
+
+istream & FFLD::operator>>(istream & is, GSHOTPyramid & pyramid)
+{
+    const string buffer((istreambuf_iterator<char>(is)), istreambuf_iterator<char>());
+
+    if (!readPyramid(buffer.data(), buffer.size(), pyramid))
+        is.setstate(ios::failbit);
+
+    return is;
+}
+
 //Read point cloud from a path
 int FFLD::readPointCloud(std::string object_path, PointCloudPtr point_cloud){
     std::string extension = boost::filesystem::extension(object_path);
@@ -65,6 +65,10 @@ double LBFGS::operator()(double * argx) const
 	// Convert the current solution to an Eigen::Map
 	Eigen::Map<VectorXd> x(argx, function_->dim());
 
+	// Whether the line-searches can be done along the directions
+	const IDirectionalFunction * directional =
+		dynamic_cast<const IDirectionalFunction *>(function_);
+	
 	// Initial value of the objective function and gradient
 	VectorXd g(x.rows());
 	double fx = (*function_)(x.data(), g.data());
@@ -140,17 +144,37 @@ double LBFGS::operator()(double * argx) const
 		bool down = false;
 		int ls;
 		
+		if (directional)
+			directional->direction(x.data(), z.data());
+		
 		for (ls = 0; ls < maxLineSearches_; ++ls) {
 			// Tentative solution, gradient and loss
 			const VectorXd nx = x - step * z;
-			VectorXd ng(x.rows());
-			const double nfx = (*function_)(nx.data(), ng.data());
+			VectorXd ng;
+			double nfx;
+			double slope;
+			
+			if (directional) {
+				nfx = directional->line(step, slope);
+			}
+			else {
+				ng.resize(x.rows());
+				nfx = (*function_)(nx.data(), ng.data());
+				slope = -z.dot(ng);
+			}
 			
             if (nfx <= fx + 0.0001 * step * descent) { // First Wolfe condition
-                if ((-z.dot(ng) >= 0.9 * descent) || down) { // Second Wolfe condition
+                if ((slope >= 0.9 * descent) || down) { // Second Wolfe condition
 					x = nx;
-					g = ng;
-					fx = nfx;
+					
+					if (directional) {
+						fx = directional->line(step, slope, g.data());
+					}
+					else {
+						g = ng;
+						fx = nfx;
+					}
+					
 					break;
 				}
 				else {
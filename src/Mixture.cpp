@@ -6,11 +6,38 @@
 #include <cmath>
 #include <fstream>
 #include <iostream>
+#include <random>
+#include <sstream>
 
 using namespace Eigen;
 using namespace FFLD;
 using namespace std;
 
+namespace
+{
+// Returns the bounds of the grid of a scene (min snapped on the scene resolution)
+void SceneBounds(const PointCloudT & cloud, float resolution, PointType & min, PointType & max)
+{
+    PointType minTmp;
+    pcl::getMinMax3D(cloud, minTmp, max);
+
+    min = PointType();
+    min.x = floor(minTmp.x/resolution)*resolution;
+    min.y = floor(minTmp.y/resolution)*resolution;
+    min.z = floor(minTmp.z/resolution)*resolution;
+}
+
+// Key of a pyramid in the scene cache
+string PyramidKey(const Scene & scene, Vector3i boxSize, int nbParts, int interval,
+                  int densityThreshold, const string & variant = string())
+{
+    ostringstream key;
+    key << scene.filename() << ' ' << scene.resolution() << ' ' << boxSize.transpose() << ' '
+        << nbParts << ' ' << interval << ' ' << densityThreshold << ' ' << variant;
+    return key.str();
+}
+}
+
 Mixture::Mixture() : cached_(false), zero_(true)
 {
 }
@@ -61,6 +88,7 @@ const vector<Model> & Mixture::models() const
 
 vector<Model> & Mixture::models()
 {
+	cached_ = false;
 	return models_;
 }
 
@@ -100,7 +128,7 @@ Vector3i Mixture::maxSize() const
 
 double Mixture::train(const vector<Scene> & scenes, Object::Name name, int nbParts,
 					  int interval, int nbRelabel, int nbDatamine, int maxNegatives, double C,
-                      double J, double overlap, float negOverlap)
+                      double J, double overlap, float negOverlap, Solver solver)
 {
     if (empty() || scenes.empty() || (interval < 1) ||
 		(nbRelabel < 1) || (nbDatamine < 1) || (maxNegatives < models_.size()) || (C <= 0.0) ||
@@ -179,7 +207,7 @@ double Mixture::train(const vector<Scene> & scenes, Object::Name name, int nbPar
             const int maxIterations =
                 min(max(10.0 * sqrt(static_cast<double>(positives.size())), 100.0), 1000.0);
 
-            loss = trainSVM(positives, negatives, C, J, maxIterations);
+            loss = trainSVM(positives, negatives, C, J, maxIterations, solver);
 
             cout << "Relabel: " << relabel << ", datamine: " << datamine
                  << ", # positives: " << positives.size() << ", # hard negatives: " << j
@@ -223,6 +251,11 @@ double Mixture::train(const vector<Scene> & scenes, Object::Name name, int nbPar
 	return loss;
 }
 
+SceneCache & Mixture::sceneCache() const
+{
+	return sceneCache_;
+}
+
 void Mixture::initializeParts(int nbParts, GSHOTPyramid::Level parts)
 {
     for (int i = 0; i < models_.size(); ++i) {
@@ -241,23 +274,15 @@ void Mixture::initializeParts(int nbParts, GSHOTPyramid::Level parts)
 	zero_ = false;
 }
 
-void Mixture::computeScores(const GSHOTPyramid & pyramid, vector<vector<Tensor3DF> > & scores,
+void Mixture::computeScores(const GSHOTPyramid & pyramid, vector<Tensor3DPackF> & scores,
                                   vector<Indices> & argmaxes,
-                                  vector<vector<vector<vector<Model::Positions> > > >* positions) const
+                                  vector<vector<vector<Model::LevelPositions> > >* positions) const
 {
     cout << "computeScores::start" << endl;
 
     const int nbModels = static_cast<int>(models_.size());
     const int nbLevels = static_cast<int>(pyramid.levels().size());
 
-
-    // Resize the scores and argmaxes
-    scores.resize(nbLevels);
-    for(int i=0;i<nbLevels;++i){
-        scores[i].resize(pyramid.levels()[i].size());
-    }
-    argmaxes.resize(nbLevels);
-
     if (empty() || pyramid.empty()) {
         if(empty())
             cout << "computeEnergyScores::mixture models are empty" << empty() << endl;
@@ -273,7 +298,7 @@ void Mixture::computeScores(const GSHOTPyramid & pyramid, vector<vector<Tensor3D
     }
 
     // Convolve with all the models
-    vector<vector<vector<Tensor3DF> > > convolutions;//[model][lvl][box]
+    vector<vector<Tensor3DPackF> > convolutions;//[model][lvl][box]
     convolve(pyramid, convolutions, positions);
 
     // In case of error
@@ -291,46 +316,45 @@ void Mixture::computeScores(const GSHOTPyramid & pyramid, vector<vector<Tensor3D
 
     cout << "computeScores::middle" << endl;
 
-#pragma omp parallel for
-    for (int lvl = 0; lvl < nbLevels; ++lvl) {
-#pragma omp parallel for
-        for (int box = 0; box < pyramid.levels()[lvl].size(); ++box) {
-
-            int rows = static_cast<int>(convolutions[0][lvl][box].rows());
-            int cols = static_cast<int>(convolutions[0][lvl][box].cols());
-            int depths = static_cast<int>(convolutions[0][lvl][box].depths());
-
-
-//            for (int i = 1; i < nbModels; ++i) {
-//                rows = std::min(rows, static_cast<int>(convolutions[i][lvl][box].rows()));
-//                cols = std::min(cols, static_cast<int>(convolutions[i][lvl][box].cols()));
-//                depths = std::min(depths, static_cast<int>(convolutions[i][lvl][box].depths()));
-//            }
-
+    // Score of the best model at each position and its index, all the boxes of a level at once
+    scores.resize(nbLevels);
+    argmaxes.resize(nbLevels);
 
-            scores[lvl][box]().resize(Eigen::array<long int, 3>{{depths, rows, cols}});//convolution score of the best model at x, y, z
-            argmaxes[lvl]().resize(Eigen::array<long int, 3>{{depths, rows, cols}});//indice of the best model at x, y, z
+    // A single model is its own best one
+    if (nbModels == 1) {
+        for (int lvl = 0; lvl < nbLevels; ++lvl) {
+            scores[lvl].swap(convolutions[0][lvl]);
+            argmaxes[lvl].resizeLike(scores[lvl]);
+            argmaxes[lvl].setConstant(0);
+        }
 
-//            cout<<"ComputeScore:: score.depths() : "<< scores[lvl][box].depths() << endl;
-//            cout<<"ComputeScore:: score.rows() : "<< scores[lvl][box].rows() << endl;
-//            cout<<"ComputeScore:: score.cols() : "<< scores[lvl][box].cols() << endl;
+        cout << "computeScores::end" << endl;
+        return;
+    }
 
-            for (int z = 0; z < depths; ++z) {
-                for (int y = 0; y < rows; ++y) {
-                    for (int x = 0; x < cols; ++x) {
-                        int argmax = 0;
+#pragma omp parallel for
+    for (int lvl = 0; lvl < nbLevels; ++lvl) {
+        scores[lvl].resizeLike(convolutions[0][lvl]);
+        argmaxes[lvl].resizeLike(convolutions[0][lvl]);
+
+        // The models are compared cell by cell, only the ones with the same score sizes as the
+        // first one can be
+        vector<int> models(1, 0);
+        for (int i = 1; i < nbModels; ++i){
+            if (convolutions[i][lvl].sizes() == convolutions[0][lvl].sizes())
+                models.push_back(i);
+        }
 
-                        for (int i = 1; i < nbModels; ++i){
-                            if (convolutions[i][lvl][box]()(z, y, x) > convolutions[argmax][lvl][box]()(z, y, x))
-                                argmax = i;
-                        }
+        for (int j = 0; j < scores[lvl].nbElements(); ++j) {
+            int argmax = 0;
 
-                        scores[lvl][box]()(z, y, x) = convolutions[argmax][lvl][box]()(z, y, x);
-                        argmaxes[lvl]()(z, y, x) = argmax;
-                    }
-                }
+            for (int k = 1; k < models.size(); ++k){
+                if (convolutions[models[k]][lvl].data()[j] > convolutions[argmax][lvl].data()[j])
+                    argmax = models[k];
             }
-    //        cout << "Mix::computeScores scores["<<lvl<<"] is zero = "<<scores[lvl].isZero() << endl;
+
+            scores[lvl].data()[j] = convolutions[argmax][lvl].data()[j];
+            argmaxes[lvl].data()[j] = argmax;
         }
     }
     cout << "computeScores::end" << endl;
@@ -366,17 +390,37 @@ vector<Rectangle> Mixture::posLatentSearch(const vector<Scene> & scenes, Object:
         }
 		
         if (!colors.empty()){
-		
-            PointCloudPtr cloud( new PointCloudT);
 
-            if( readPointCloud(scenes[i].filename(), cloud) == -1) {
-                cout<<"couldnt open pcd file"<<endl;
-                positives.clear();
-                return recs;
+            // The pyramid of the positives only depends on the scene and on the colors of its objects
+            ostringstream variant;
+            variant << "pos";
+            for (int j = 0; j < colors.size(); ++j){
+                variant << ' ' << colors[j].transpose();
             }
+            const string key = PyramidKey(scenes[i], models()[0].boxSize_, models_[0].parts().size(),
+                                          interval, 5, variant.str());
+
+            SceneCache::PyramidConstPtr cached = sceneCache_.pyramid(key);
+
+            if (!cached) {
+                boost::shared_ptr<GSHOTPyramid> built(new GSHOTPyramid(models()[0].boxSize_,
+                                                                       models_[0].parts().size(),
+                                                                       interval, scenes[i].resolution()));
+                const string cachePath = GSHOTPyramid::CachePath(scenes[i].filename(), scenes[i].resolution(),
+                                                                 models()[0].boxSize_, models_[0].parts().size(),
+                                                                 interval, built->nbOctave_, 5, variant.str());
+
+                if (cachePath.empty() || !built->load(cachePath)) {
+                    PointCloudPtr cloud = sceneCache_.cloud(scenes[i].filename());
+
+                    if( !cloud) {
+                        cout<<"couldnt open pcd file"<<endl;
+                        positives.clear();
+                        return recs;
+                    }
 
-            PointCloudPtr finalCloud (new PointCloudT( 0,1,PointType()));
-            cout << "Mix::posLatentSearch finalCloud.size : " << finalCloud->size() << endl;
+                    PointCloudPtr finalCloud (new PointCloudT( 0,1,PointType()));
+                    cout << "Mix::posLatentSearch finalCloud.size : " << finalCloud->size() << endl;
 
 //            if (!zero_){
 //                for(int j = 0; j < colors.size(); ++j){
@@ -401,52 +445,52 @@ vector<Rectangle> Mixture::posLatentSearch(const vector<Scene> & scenes, Object:
 //                }
 
 //            }else{
-                for(int k = 0; k < cloud->size(); ++k){
-                    for(int j = 0; j < colors.size(); ++j){
-                        if( cloud->points[k].getRGBVector3i() == colors[j])
-                        {
-                            finalCloud->width    = finalCloud->points.size()+1;
-                            finalCloud->height   = 1;
-                            finalCloud->points.resize (finalCloud->width);
-                            finalCloud->at(finalCloud->points.size()-1) = cloud->points[k];
+                        for(int k = 0; k < cloud->size(); ++k){
+                            for(int j = 0; j < colors.size(); ++j){
+                                if( cloud->points[k].getRGBVector3i() == colors[j])
+                                {
+                                    finalCloud->width    = finalCloud->points.size()+1;
+                                    finalCloud->height   = 1;
+                                    finalCloud->points.resize (finalCloud->width);
+                                    finalCloud->at(finalCloud->points.size()-1) = cloud->points[k];
+                                }
+                            }
                         }
-                    }
-                }
 //            }
 
 
-            GSHOTPyramid pyramid(models()[0].boxSize_, models_[0].parts().size(), interval, scenes[i].resolution());
 
+                    cout << "Mix::posLatentSearch finalCloud.size2 : " << finalCloud->size() << endl;
 
-            cout << "Mix::posLatentSearch finalCloud.size2 : " << finalCloud->size() << endl;
+                    PointType min;
+                    PointType max;
+                    SceneBounds(*cloud, scenes[i].resolution(), min, max);
 
-            PointType minTmp;
-            PointType min;
-            PointType max;
-            pcl::getMinMax3D(*cloud, minTmp, max);
+//            pyramid.createFilteredPyramid(finalCloud, models_[0].parts()[0].filter,
+//                    min, max, 0, 20);
+                    built->createFullPyramid(finalCloud, min, max, 5);
+
+                    if (!cachePath.empty()){
+                        built->save(cachePath);
+                    }
+                }
 
-            min.x = floor(minTmp.x/scenes[i].resolution())*scenes[i].resolution();
-            min.y = floor(minTmp.y/scenes[i].resolution())*scenes[i].resolution();
-            min.z = floor(minTmp.z/scenes[i].resolution())*scenes[i].resolution();
+                sceneCache_.insert(key, built);
+                cached = built;
+            }
 
+            const GSHOTPyramid & pyramid = *cached;
 
-            vector<vector<Tensor3DF> > scores;//[lvl][box]
+            vector<Tensor3DPackF> scores;//[lvl][box]
             vector<Indices> argmaxes;//indices of model
-            vector<vector<vector<vector<Model::Positions> > > >positions;//positions[nbModels][nbLvl][nbPart][box]
+            vector<vector<vector<Model::LevelPositions> > >positions;//positions[nbModels][nbPart][nbLvl][box]
 
             if (!zero_){
-//                pyramid.createFilteredPyramid(finalCloud, models_[0].parts()[0].filter,
-//                        min, max, 0, 20);
-                pyramid.createFullPyramid(finalCloud, min, max, 5);
-
                 //only remaines score for the last octave
                 computeScores(pyramid, scores, argmaxes, &positions);
-            }else{
-                pyramid.createFullPyramid(finalCloud, min, max, 5);
             }
 
 
-
             if (pyramid.empty()) {
                 cout<<"posLatentSearch::pyramid.empty"<<endl;
                 positives.clear();
@@ -578,7 +622,7 @@ vector<Rectangle> Mixture::posLatentSearch(const vector<Scene> & scenes, Object:
                                 argLvl = lvl;
 
                                 if (!zero_){
-                                    maxScore = scores[lvl][box]()(0,0,0);
+                                    maxScore = scores[lvl][box](0,0,0);
     //                                cout << "Mix::posLatentSearch set maxScore = " << maxScore<< endl;
                                 }
 
@@ -711,30 +755,70 @@ void Mixture::negLatentSearch(const vector<Scene> & scenes, Object::Name name,
             }
         }
 
-        PointCloudPtr cloud( new PointCloudT);
+        // The full pyramid of the scene is cached, the boxes matching the root are kept afterwards
+        const string key = PyramidKey(scenes[i], models()[0].boxSize_, models_[0].parts().size(),
+                                      interval, 20);
+        const int nbOctave = 2;
+
+        SceneCache::PyramidConstPtr fullPyramid = sceneCache_.pyramid(key);
+        const string cachePath = fullPyramid ? string() :
+                GSHOTPyramid::CachePath(scenes[i].filename(), scenes[i].resolution(),
+                                        models()[0].boxSize_, models_[0].parts().size(),
+                                        interval, nbOctave, 20);
+
+        // Without any cache, only the descriptors of the matching boxes are computed
+        if (!fullPyramid && (sceneCache_.budget() || !cachePath.empty())) {
+            boost::shared_ptr<GSHOTPyramid> built(new GSHOTPyramid(models()[0].boxSize_,
+                                                                   models_[0].parts().size(),
+                                                                   interval, scenes[i].resolution(),
+                                                                   nbOctave));
+
+            if (cachePath.empty() || !built->load(cachePath)) {
+                PointCloudPtr cloud = sceneCache_.cloud(scenes[i].filename());
+
+                if (!cloud) {
+                    cout<<"Mix::negLatentSearch couldnt load PCD file"<<endl;
+                    negatives.clear();
+                    return;
+                }
 
-        if (readPointCloud(scenes[i].filename(), cloud) == -1) {
-            cout<<"Mix::negLatentSearch couldnt load PCD file"<<endl;
-            negatives.clear();
-            return;
-        }
+                PointType min;
+                PointType max;
+                SceneBounds(*cloud, scenes[i].resolution(), min, max);
 
+                built->createFullPyramid(cloud, min, max, 20);
 
-        PointType minTmp;
-        PointType min;
-        PointType max;
-        pcl::getMinMax3D(*cloud, minTmp, max);
+                if (!cachePath.empty()) {
+                    built->save(cachePath);
+                }
+            }
 
-        min.x = floor(minTmp.x/scenes[i].resolution())*scenes[i].resolution();
-        min.y = floor(minTmp.y/scenes[i].resolution())*scenes[i].resolution();
-        min.z = floor(minTmp.z/scenes[i].resolution())*scenes[i].resolution();
+            sceneCache_.insert(key, built);
+            fullPyramid = built;
+        }
 
         GSHOTPyramid pyramid(models()[0].boxSize_, models_[0].parts().size(), interval, scenes[i].resolution());
 
+        if (fullPyramid) {
+            pyramid.filterBoxes(*fullPyramid, models_[0].parts()[0].filter, 0);
+        }
+        else {
+            PointCloudPtr cloud = sceneCache_.cloud(scenes[i].filename());
 
-        pyramid.createFilteredPyramid(cloud, models_[0].parts()[0].filter,
-                min, max, 0, 20);
-//        pyramid.createFullPyramid(cloud, min, max, 50);
+            if (!cloud) {
+                cout<<"Mix::negLatentSearch couldnt load PCD file"<<endl;
+                negatives.clear();
+                return;
+            }
+
+            PointType min;
+            PointType max;
+            SceneBounds(*cloud, scenes[i].resolution(), min, max);
+
+            pyramid.createFilteredPyramid(cloud, models_[0].parts()[0].filter,
+                    min, max, 0, 20);
+//            pyramid.createFullPyramid(cloud, min, max, 50);
+        }
 
         if (pyramid.empty()) {
             cout<<"Mix::negLatentSearch pyramid empty"<<endl;
@@ -742,9 +826,9 @@ void Mixture::negLatentSearch(const vector<Scene> & scenes, Object::Name name,
             return;
         }
 
-        vector<vector<Tensor3DF> >scores;
+        vector<Tensor3DPackF> scores;
         vector<Indices> argmaxes;
-        vector<vector<vector<vector<Model::Positions> > > >positions;
+        vector<vector<vector<Model::LevelPositions> > >positions;
 
         if (!zero_){
             computeScores(pyramid, scores, argmaxes, &positions);
@@ -788,8 +872,8 @@ void Mixture::negLatentSearch(const vector<Scene> & scenes, Object::Name name,
                                     bestNeg.push_back( ScoreStruct( 0, lvl, box, z, y, x));
                                 }
                             } else{
-                                if(!intersection && scores[lvl][box]()(z, y, x) > -1/*negatives.last().first.parts()[0].deformation(7)*/){
-                                    bestNeg.push_back( ScoreStruct( scores[lvl][box]()(z, y, x), lvl, box, z, y, x));
+                                if(!intersection && scores[lvl][box](z, y, x) > -1/*negatives.last().first.parts()[0].deformation(7)*/){
+                                    bestNeg.push_back( ScoreStruct( scores[lvl][box](z, y, x), lvl, box, z, y, x));
                                 }
                             }
                         }
@@ -875,151 +959,312 @@ namespace FFLD
 {
 namespace detail
 {
-class Loss : public LBFGS::IFunction
+class Loss : public LBFGS::IDirectionalFunction
 {
 public:
 	Loss(vector<Model> & models, const vector<pair<Model, int> > & positives,
 		 const vector<pair<Model, int> > & negatives, double C, double J, int maxIterations) :
-	models_(models), positives_(positives), negatives_(negatives), C_(C), J_(J),
-	maxIterations_(maxIterations)
-	{
-	}
-	
-	virtual int dim() const
+	models_(models), C_(C), J_(J), maxIterations_(maxIterations), offsets_(models.size() + 1, 0),
+	deformations_(models.size()), constraints_(models.size()), samples_(models.size()),
+	constrained_(models.size()), positives_(positives.size()), negatives_(negatives.size()),
+	norms_(negatives.size()), rows_(models.size()), shrunk_(negatives.size(), false),
+	slacks_(negatives.size(), 0.0), inactive_(negatives.size(), 0), nbDirections_(0),
+	projections_(models.size())
 	{
-		int d = 0;
-		
+		// Offsets of the parameters of each model in x, of the deformations of its parts, and of
+		// the deformation coefficients with a minimum constraint
 		for (int i = 0; i < models_.size(); ++i) {
+			int d = 0;
+			
 			for (int j = 0; j < models_[i].parts().size(); ++j) {
                 d += models_[i].parts()[j].filter.size() * GSHOTPyramid::DescriptorSize; // Filter
 				
-				if (j)
+				if (j) {
+					deformations_[i].push_back(d);
+					
+					for (int k = 0; k < 8; k += 2)
+						constraints_[i].push_back(d + k);
+					
                     d += 8; // Deformation
+				}
 			}
 			
-			++d; // Bias
+			offsets_[i + 1] = offsets_[i] + d + 1; // Bias
 		}
 		
-		return d;
+		// Pack the samples of each model in the rows of a single matrix, in the layout of x, so
+		// that all the margins are products with the parameters
+		vector<int> nbRows(models_.size(), 0);
+		
+		for (int i = 0; i < positives.size(); ++i)
+			positives_[i] = make_pair(positives[i].second, nbRows[positives[i].second]++);
+		
+		for (int i = 0; i < negatives.size(); ++i)
+			negatives_[i] = make_pair(negatives[i].second, nbRows[negatives[i].second]++);
+		
+		for (int i = 0; i < models_.size(); ++i)
+			samples_[i].resize(nbRows[i], offsets_[i + 1] - offsets_[i]);
+		
+		#pragma omp parallel for
+		for (int i = 0; i < positives.size(); ++i)
+			FromModel(positives[i].first,
+					  samples_[positives_[i].first].row(positives_[i].second).data());
+		
+		#pragma omp parallel for
+		for (int i = 0; i < negatives.size(); ++i)
+			FromModel(negatives[i].first,
+					  samples_[negatives_[i].first].row(negatives_[i].second).data());
+		
+		// Copy of the constrained columns for the line searches
+		for (int i = 0; i < models_.size(); ++i) {
+			constrained_[i].resize(nbRows[i], constraints_[i].size());
+			
+			for (int j = 0; j < constraints_[i].size(); ++j)
+				constrained_[i].col(j) = samples_[i].col(constraints_[i][j]);
+		}
+		
+		// Norms of the negatives to bound their margins once shrunk
+		for (int i = 0; i < negatives.size(); ++i)
+			norms_[i] = samples_[negatives_[i].first].row(negatives_[i].second).norm();
+		
+		makeBlocks();
+	}
+	
+	virtual int dim() const
+	{
+		return offsets_.back();
 	}
 	
 	virtual double operator()(const double * x, double * g = 0) const
 	{
-		// Recopy the features into the models
-		ToModels(x, models_);
+		VectorXd w = Map<const VectorXd>(x, dim());
 		
-		// Compute the loss and gradient over the samples
-		double loss = 0.0;
+		constrain(w);
 		
-		vector<Model> gradients;
+		// Bring back the shrunk negatives which might be active
+		if (reference_.size())
+			reactivate((w - reference_).norm(), false);
 		
-		if (g) {
-			gradients.resize(models_.size());
+		const VectorXf wf = w.cast<float>();
+		
+		// Compute the margins of the active samples, a block of rows at a time
+		vector<VectorXf> margins(models_.size());
+		
+		for (int i = 0; i < models_.size(); ++i)
+			margins[i].setZero(samples_[i].rows());
+		
+		#pragma omp parallel for
+		for (int i = 0; i < blocks_.size(); ++i) {
+			const int model = blocks_[i](0);
 			
-			for (int i = 0; i < models_.size(); ++i)
-				gradients[i] = Model(models_[i].rootSize(),
-									 static_cast<int>(models_[i].parts().size()) - 1,
-									 models_[i].partSize());
+			for (int j = blocks_[i](1); j < blocks_[i](1) + blocks_[i](2); ++j) {
+				const int row = rows_[model][j];
+				
+				margins[model](row) = samples_[model].row(row).dot(
+										  wf.segment(offsets_[model], samples_[model].cols()));
+			}
 		}
-
-
-        vector<double> posMargins(positives_.size());
 		
-//#pragma omp parallel for
-		for (int i = 0; i < positives_.size(); ++i)
-			posMargins[i] = models_[positives_[i].second].dot(positives_[i].first);
+		vector<VectorXf> coefficients;
+		int argNorm;
 		
-// Never use #pragma omp parallel for HERE
-		for (int i = 0; i < positives_.size(); ++i) {
-			if (posMargins[i] < 1.0) {
-				loss += 1.0 - posMargins[i];
+		return evaluate(w, margins, coefficients, argNorm, g);
+	}
+	
+	// The margins are affine in the step, except for the constrained coefficients. The
+	// projections of the samples on the solution and on the direction (without the constrained
+	// coefficients) are computed while each row is in cache, then those on the whole direction
+	virtual void direction(const double * x, const double * z) const
+	{
+		x_ = Map<const VectorXd>(x, dim());
+		z_ = Map<const VectorXd>(z, dim());
+		
+		VectorXd w = x_;
+		
+		constrain(w);
+		
+		// Periodically tighten the bounds of the shrunk negatives
+		if (reference_.size() && (++nbDirections_ % CheckIterations == 0))
+			check(w);
+		
+		// The constrained coefficients move at most as much as the others, so the distance to
+		// the reference solution grows at most by the norm of the direction times the step
+		radius_ = reference_.size() ? (w - reference_).norm() : 0.0;
+		zNorm_ = z_.norm();
+		
+		reactivate(radius_, false);
+		
+		xz_.resize(dim(), 2);
+		xz_.col(0) = x_.cast<float>();
+		xz_.col(1) = z_.cast<float>();
+		
+		for (int i = 0; i < models_.size(); ++i) {
+			projections_[i].setZero(samples_[i].rows(), 3);
+			
+			for (int j = 0; j < constraints_[i].size(); ++j)
+				xz_.row(offsets_[i] + constraints_[i][j]).setZero();
+		}
+		
+		#pragma omp parallel for
+		for (int i = 0; i < blocks_.size(); ++i)
+			for (int j = blocks_[i](1); j < blocks_[i](1) + blocks_[i](2); ++j)
+				project(blocks_[i](0), rows_[blocks_[i](0)][j]);
+		
+		for (int i = 0; i < models_.size(); ++i)
+			projections_[i].col(2) = projections_[i].col(1) +
+									 constrained_[i] * constrainedValues(z_, i);
+		
+		maxStep_ = (minSlack() - radius_) / zNorm_;
+	}
+	
+	virtual double line(double step, double & slope, double * g = 0) const
+	{
+		// Bring back the shrunk negatives which might be active
+		if (step >= maxStep_) {
+			reactivate(radius_ + step * zNorm_, true);
+			maxStep_ = (minSlack() - radius_) / zNorm_;
+		}
+		
+		VectorXd w = x_ - step * z_;
+		
+		constrain(w);
+		
+		vector<VectorXf> margins(models_.size());
+		
+		for (int i = 0; i < models_.size(); ++i)
+			margins[i] = projections_[i].col(0) -
+						 static_cast<float>(step) * projections_[i].col(1) +
+						 constrained_[i] * constrainedValues(w, i);
+		
+		vector<VectorXf> coefficients;
+		int argNorm;
+		
+		const double value = evaluate(w, margins, coefficients, argNorm, g);
+		
+		if (g) {
+			slope = -z_.dot(Map<const VectorXd>(g, dim()));
+			return value;
+		}
+		
+		// Derivative of the loss
+		slope = 0.0;
+		
+		for (int i = 0; i < models_.size(); ++i)
+			slope -= coefficients[i].dot(projections_[i].col(2));
+		
+		// Derivative of the regularization term
+		const int offset = offsets_[argNorm];
+		const int nbParameters = offsets_[argNorm + 1] - offset - 1; // Without the bias
+		
+		slope -= z_.segment(offset, nbParameters).dot(w.segment(offset, nbParameters));
+		
+		for (int j = 0; j < deformations_[argNorm].size(); ++j)
+			slope -= 9.0 * z_.segment(offset + deformations_[argNorm][j], 8).dot(
+						   w.segment(offset + deformations_[argNorm][j], 8));
+		
+		// Remove the negative gradients of the constrained coefficients at their bound
+		for (int i = 0; i < models_.size(); ++i) {
+			for (int j = 0; j < constraints_[i].size(); ++j) {
+				const int l = offsets_[i] + constraints_[i][j];
 				
-				if (g)
-					gradients[positives_[i].second] -= positives_[i].first;
-            }
+				if (w(l) >= -0.005) {
+					double gl = coefficients[i].dot(constrained_[i].col(j));
+					
+					if (i == argNorm)
+						gl += 10.0 * w(l);
+					
+					if (gl < 0.0)
+						slope += z_(l) * gl;
+				}
+			}
 		}
 		
-
-        // Reweight thpositives
-		if (J_ != 1.0) {
-			loss *= J_;
+		return value;
+	}
+	
+	// Minimizes the objective function by dual coordinate descent, as in LIBLINEAR, starting from
+	// zero. Returns the objective function of the solution written in x.
+	// The components are independent given a distribution mu over them, which turns the maximum
+	// of their norms into a weighted sum. The problem is solved for each component, with a
+	// regularization of mu_k, then mu is updated by exponentiated gradient ascent until all the
+	// components it weights have the largest norm. The parameters are derived from the dual
+	// variables by clamping those with a minimum constraint, which is their exact solution under
+	// the constraint. The bias is regularized as with a bias feature of BiasScale, like in
+	// Felzenszwalb's code, since a free bias does not decompose over the samples
+	double solveDual(double * x, double epsilon, int maxIterations) const
+	{
+		const int nbModels = static_cast<int>(models_.size());
+		
+		// Inverse regularization weights of the parameters of each model
+		vector<VectorXd> inverses(nbModels);
+		
+		for (int i = 0; i < nbModels; ++i) {
+			inverses[i].setOnes(samples_[i].cols());
 			
-			if (g) {
-				for (int i = 0; i < models_.size(); ++i)
-					gradients[i] *= J_;
-			}
+			for (int j = 0; j < deformations_[i].size(); ++j)
+				inverses[i].segment(deformations_[i][j], 8).fill(0.1);
+			
+			inverses[i](samples_[i].cols() - 1) = BiasScale * BiasScale;
 		}
-
-		vector<double> negMargins(negatives_.size());
 		
-//#pragma omp parallel for
-		for (int i = 0; i < negatives_.size(); ++i)
-			negMargins[i] = models_[negatives_[i].second].dot(negatives_[i].first);
+		// Rows, labels and upper bounds of the dual variables of the samples of each model
+		vector<vector<int> > rows(nbModels);
+		vector<vector<int> > labels(nbModels);
+		vector<vector<double> > bounds(nbModels);
+		
+		for (int i = 0; i < positives_.size(); ++i) {
+			rows[positives_[i].first].push_back(positives_[i].second);
+			labels[positives_[i].first].push_back(1);
+			bounds[positives_[i].first].push_back(J_ * C_);
+		}
 		
-//#pragma omp parallel for
 		for (int i = 0; i < negatives_.size(); ++i) {
-			if (negMargins[i] > -1.0) {
-				loss += 1.0 + negMargins[i];
-				
-				if (g)
-					gradients[negatives_[i].second] += negatives_[i].first;
-			}
+			rows[negatives_[i].first].push_back(negatives_[i].second);
+			labels[negatives_[i].first].push_back(-1);
+			bounds[negatives_[i].first].push_back(C_);
 		}
-
-		// Add the loss and gradient of the regularization term
-		double maxNorm = 0.0;
-		int argNorm = 0;
 		
-		for (int i = 0; i < models_.size(); ++i) {
-			if (g)
-				gradients[i] *= C_;
-
-			const double norm = models_[i].norm();
-
-			if (norm > maxNorm) {
-				maxNorm = norm;
-				argNorm = i;
-			}
+		// Dual variables and their weighted sums
+		vector<vector<double> > alphas(nbModels);
+		vector<VectorXd> sums(nbModels);
+		vector<VectorXf> weights(nbModels);
+		
+		for (int i = 0; i < nbModels; ++i) {
+			alphas[i].resize(rows[i].size(), 0.0);
+			sums[i].setZero(samples_[i].cols());
 		}
-
-		// Recopy the gradient if needed
-		if (g) {
-			// Regularization gradient
-			gradients[argNorm] += models_[argNorm];
+		
+		VectorXd mu = VectorXd::Constant(nbModels, 1.0 / nbModels);
+		
+		for (int t = 0; t < MaxDistributionIterations; ++t) {
+			#pragma omp parallel for schedule(dynamic)
+			for (int i = 0; i < nbModels; ++i)
+				descend(i, mu(i), inverses[i], rows[i], labels[i], bounds[i], epsilon,
+						maxIterations, alphas[i], sums[i], weights[i]);
 			
-			// Regularize the deformation 10 times more
-			for (int i = 1; i < gradients[argNorm].parts().size(); ++i)
-				gradients[argNorm].parts()[i].deformation +=
-					9.0 * models_[argNorm].parts()[i].deformation;
+			if (nbModels == 1)
+				break;
 			
-			// Do not regularize the bias
-			gradients[argNorm].bias() -= models_[argNorm].bias();
-
-			// In case minimum constraints were applied
-			for (int i = 0; i < models_.size(); ++i) {
-				for (int j = 1; j < models_[i].parts().size(); ++j) {
-					if (models_[i].parts()[j].deformation(0) >= -0.005)
-						gradients[i].parts()[j].deformation(0) =
-							max(gradients[i].parts()[j].deformation(0), 0.0);
-					
-					if (models_[i].parts()[j].deformation(2) >= -0.005)
-						gradients[i].parts()[j].deformation(2) =
-							max(gradients[i].parts()[j].deformation(2), 0.0);
-					
-					if (models_[i].parts()[j].deformation(4) >= -0.005)
-						gradients[i].parts()[j].deformation(4) =
-							max(gradients[i].parts()[j].deformation(4), 0.0);
-
-                    if (models_[i].parts()[j].deformation(6) >= -0.005)
-                        gradients[i].parts()[j].deformation(6) =
-                            max(gradients[i].parts()[j].deformation(6), 0.0);
-				}
-			}
-
-			FromModels(gradients, g);
+			// Stop once the norms of the components weighted by mu are all close to the largest
+			VectorXd norms(nbModels);
+			
+			for (int i = 0; i < nbModels; ++i)
+				norms(i) = (weights[i].cast<double>().array().square() /
+							inverses[i].array()).sum();
+			
+			const double maxNorm = norms.maxCoeff();
+			
+			if ((maxNorm <= 0.0) || (maxNorm - mu.dot(norms) <= 0.01 * maxNorm))
+				break;
+			
+			mu = mu.array() * ((norms.array() - maxNorm) / maxNorm).exp();
+			mu /= mu.sum();
 		}
 		
-		return 0.5 * maxNorm * maxNorm + C_ * loss;
+		for (int i = 0; i < nbModels; ++i)
+			Map<VectorXd>(x + offsets_[i], samples_[i].cols()) = weights[i].cast<double>();
+		
+		return (*this)(x);
 	}
 	
 	static void ToModels(const double * x, vector<Model> & models)
@@ -1056,65 +1301,518 @@ public:
 	
 	static void FromModels(const vector<Model> & models, double * x)
 	{
-		for (int i = 0, j = 0; i < models.size(); ++i) {
-			for (int k = 0; k < models[i].parts().size(); ++k) {
-				const int nbFeatures = static_cast<int>(models[i].parts()[k].filter.size()) *
-                                       GSHOTPyramid::DescriptorSize;
+		for (int i = 0, j = 0; i < models.size(); ++i)
+			j += FromModel(models[i], x + j);
+	}
+	
+	// Flattens the parameters of a model, returns their number
+	template <typename Scalar>
+	static int FromModel(const Model & model, Scalar * x)
+	{
+		int j = 0;
+		
+		for (int k = 0; k < model.parts().size(); ++k) {
+			const int nbFeatures = static_cast<int>(model.parts()[k].filter.size()) *
+                                   GSHOTPyramid::DescriptorSize;
+			
+            copy(model.parts()[k].filter().data()->data(),
+                 model.parts()[k].filter().data()->data() + nbFeatures, x + j);
+			
+			j += nbFeatures;
+			
+			if (k) {
+				copy(model.parts()[k].deformation.data(),
+                     model.parts()[k].deformation.data() + 8, x + j);
 				
-                copy(models[i].parts()[k].filter().data()->data(),
-                     models[i].parts()[k].filter().data()->data() + nbFeatures, x + j);
+                j += 8;
+			}
+		}
+		
+		x[j] = model.bias();
+		
+		return j + 1;
+	}
+	
+private:
+	// Applies the minimum constraints to the parameters
+	void constrain(VectorXd & w) const
+	{
+		for (int i = 0; i < models_.size(); ++i)
+			for (int j = 0; j < constraints_[i].size(); ++j)
+				w(offsets_[i] + constraints_[i][j]) =
+					std::min(w(offsets_[i] + constraints_[i][j]), -0.005);
+	}
+	
+	// Returns the constrained parameters of a model
+	VectorXf constrainedValues(const VectorXd & w, int model) const
+	{
+		VectorXf values(constraints_[model].size());
+		
+		for (int j = 0; j < constraints_[model].size(); ++j)
+			values(j) = w(offsets_[model] + constraints_[model][j]);
+		
+		return values;
+	}
+	
+	// Projects a sample on the current solution and direction
+	void project(int model, int row) const
+	{
+		const int cols = static_cast<int>(samples_[model].cols());
+		
+		projections_[model](row, 0) =
+			samples_[model].row(row).dot(xz_.col(0).segment(offsets_[model], cols).transpose());
+		projections_[model](row, 1) =
+			samples_[model].row(row).dot(xz_.col(1).segment(offsets_[model], cols).transpose());
+	}
+	
+	// Dual coordinate descent with shrinking of LIBLINEAR over the samples of a model, with a
+	// regularization of mu. Resumes from the given dual variables and sums, and returns the
+	// corresponding parameters
+	void descend(int model, double mu, const VectorXd & inverses, const vector<int> & rows,
+				 const vector<int> & labels, const vector<double> & bounds, double epsilon,
+				 int maxIterations, vector<double> & alphas, VectorXd & sums,
+				 VectorXf & weights) const
+	{
+		const int nbSamples = static_cast<int>(rows.size());
+		
+		// Scales from the sums to the parameters
+		const VectorXf scales = (inverses / mu).cast<float>();
+		
+		// Diagonal of the dual Hessian
+		vector<double> diagonals(nbSamples);
+		
+		for (int i = 0; i < nbSamples; ++i)
+			diagonals[i] = (samples_[model].row(rows[i]).cast<double>().array().square() *
+							inverses.transpose().array()).sum() / mu;
+		
+		weights = (sums.cwiseProduct(inverses) / mu).cast<float>();
+		
+		for (int j = 0; j < constraints_[model].size(); ++j)
+			weights(constraints_[model][j]) = std::min(weights(constraints_[model][j]), -0.005f);
+		
+		vector<int> active(nbSamples);
+		
+		for (int i = 0; i < nbSamples; ++i)
+			active[i] = i;
+		
+		int nbActive = nbSamples;
+		double maxProjected = numeric_limits<double>::infinity();
+		double minProjected = -numeric_limits<double>::infinity();
+		
+		mt19937 generator(model);
+		
+		for (int iteration = 0; iteration < maxIterations; ++iteration) {
+			shuffle(active.begin(), active.begin() + nbActive, generator);
+			
+			double newMaxProjected = -numeric_limits<double>::infinity();
+			double newMinProjected = numeric_limits<double>::infinity();
+			
+			for (int k = 0; k < nbActive; ++k) {
+				const int i = active[k];
+				const double gradient =
+					labels[i] * samples_[model].row(rows[i]).dot(weights.transpose()) - 1.0;
 				
-				j += nbFeatures;
+				double projected = 0.0;
 				
-				if (k) {
-					copy(models[i].parts()[k].deformation.data(),
-                         models[i].parts()[k].deformation.data() + 8, x + j);
+				// Shrink the samples at a bound which are unlikely to move
+				if (alphas[i] == 0.0) {
+					if (gradient > maxProjected) {
+						swap(active[k--], active[--nbActive]);
+						continue;
+					}
 					
-                    j += 8;
+					projected = std::min(gradient, 0.0);
+				}
+				else if (alphas[i] == bounds[i]) {
+					if (gradient < minProjected) {
+						swap(active[k--], active[--nbActive]);
+						continue;
+					}
+					
+					projected = std::max(gradient, 0.0);
+				}
+				else {
+					projected = gradient;
+				}
+				
+				newMaxProjected = std::max(newMaxProjected, projected);
+				newMinProjected = std::min(newMinProjected, projected);
+				
+				if (std::abs(projected) > 1e-12) {
+					const double alpha = std::min(std::max(alphas[i] - gradient / diagonals[i],
+														   0.0), bounds[i]);
+					const double delta = (alpha - alphas[i]) * labels[i];
+					
+					alphas[i] = alpha;
+					sums += delta * samples_[model].row(rows[i]).transpose().cast<double>();
+					weights += static_cast<float>(delta) *
+							   samples_[model].row(rows[i]).transpose().cwiseProduct(scales);
+					
+					for (int j = 0; j < constraints_[model].size(); ++j) {
+						const int l = constraints_[model][j];
+						
+						weights(l) = std::min(static_cast<float>(sums(l) * scales(l)), -0.005f);
+					}
 				}
 			}
 			
-			x[j] = models[i].bias();
-			++j;
+			// Check all the samples before stopping
+			if (newMaxProjected - newMinProjected <= epsilon) {
+				if (nbActive == nbSamples)
+					break;
+				
+				nbActive = nbSamples;
+				maxProjected = numeric_limits<double>::infinity();
+				minProjected = -numeric_limits<double>::infinity();
+				continue;
+			}
+			
+			maxProjected = (newMaxProjected > 0.0) ? newMaxProjected :
+													 numeric_limits<double>::infinity();
+			minProjected = (newMinProjected < 0.0) ? newMinProjected :
+													 -numeric_limits<double>::infinity();
 		}
+		
+		// Recompute the parameters from the sums to remove the rounding errors
+		weights = (sums.cwiseProduct(inverses) / mu).cast<float>();
+		
+		for (int j = 0; j < constraints_[model].size(); ++j)
+			weights(constraints_[model][j]) = std::min(weights(constraints_[model][j]), -0.005f);
 	}
 	
-private:
+	// Returns the objective function given the constrained parameters and the margins of the
+	// samples, along with the coefficients of the samples in the gradient, and the model with the
+	// largest norm
+	double evaluate(const VectorXd & w, const vector<VectorXf> & margins,
+					vector<VectorXf> & coefficients, int & argNorm, double * g) const
+	{
+		const int nbModels = static_cast<int>(models_.size());
+		
+		// Compute the loss over the samples, summed in order. The positive and regularization
+		// weights of the violating samples are kept for the gradient
+		double loss = 0.0;
+		
+		coefficients.resize(nbModels);
+		
+		for (int i = 0; i < nbModels; ++i)
+			coefficients[i].setZero(samples_[i].rows());
+		
+		for (int i = 0; i < positives_.size(); ++i) {
+			const double margin = margins[positives_[i].first](positives_[i].second);
+			
+			if (margin < 1.0) {
+				loss += 1.0 - margin;
+				coefficients[positives_[i].first](positives_[i].second) = -J_ * C_;
+			}
+		}
+		
+        // Reweight thpositives
+		if (J_ != 1.0)
+			loss *= J_;
+		
+		// The shrunk negatives are inactive
+		for (int i = 0; i < negatives_.size(); ++i) {
+			if (shrunk_[i])
+				continue;
+			
+			const double margin = margins[negatives_[i].first](negatives_[i].second);
+			
+			if (margin > -1.0) {
+				loss += 1.0 + margin;
+				coefficients[negatives_[i].first](negatives_[i].second) = C_;
+			}
+		}
+		
+		// Each thread sums the gradients of the violating samples of a static share of the
+		// blocks in its own buffer, the buffers are then summed pairwise in a fixed order. The
+		// gradient only depends on the number of threads, not on their scheduling
+		if (g) {
+			vector<VectorXf> threadGradients;
+			
+			#pragma omp parallel
+			{
+				#pragma omp single
+				threadGradients.resize(omp_get_num_threads());
+				
+				const int nbThreads = static_cast<int>(threadGradients.size());
+				VectorXf & local = threadGradients[omp_get_thread_num()];
+				
+				local.setZero(dim());
+				
+				#pragma omp for schedule(static)
+				for (int i = 0; i < blocks_.size(); ++i) {
+					const int model = blocks_[i](0);
+					
+					for (int j = blocks_[i](1); j < blocks_[i](1) + blocks_[i](2); ++j) {
+						const int row = rows_[model][j];
+						
+						if (coefficients[model](row))
+							local.segment(offsets_[model], samples_[model].cols()) +=
+								coefficients[model](row) * samples_[model].row(row).transpose();
+					}
+				}
+				
+				for (int stride = 1; stride < nbThreads; stride *= 2) {
+					#pragma omp for schedule(static)
+					for (int t = 0; t < nbThreads - stride; t += 2 * stride)
+						threadGradients[t] += threadGradients[t + stride];
+				}
+			}
+			
+			Map<VectorXd>(g, dim()) = threadGradients[0].cast<double>();
+		}
+		
+		// Add the loss and gradient of the regularization term, the deformations are regularized
+		// 10 times more and the bias not at all
+		double maxNorm = 0.0;
+		
+		argNorm = 0;
+		
+		for (int i = 0; i < nbModels; ++i) {
+			double n = w.segment(offsets_[i], offsets_[i + 1] - offsets_[i] - 1).squaredNorm();
+			
+			for (int j = 0; j < deformations_[i].size(); ++j)
+				n += 9.0 * w.segment(offsets_[i] + deformations_[i][j], 8).squaredNorm();
+			
+			const double norm = sqrt(n);
+			
+			if (norm > maxNorm) {
+				maxNorm = norm;
+				argNorm = i;
+			}
+		}
+		
+		if (g) {
+			const int offset = offsets_[argNorm];
+			
+			for (int j = offset; j < offsets_[argNorm + 1] - 1; ++j)
+				g[j] += w(j);
+			
+			for (int j = 0; j < deformations_[argNorm].size(); ++j)
+				for (int k = 0; k < 8; ++k)
+					g[offset + deformations_[argNorm][j] + k] +=
+						9.0 * w(offset + deformations_[argNorm][j] + k);
+			
+			// In case minimum constraints were applied
+			for (int i = 0; i < nbModels; ++i) {
+				for (int j = 0; j < constraints_[i].size(); ++j) {
+					const int l = offsets_[i] + constraints_[i][j];
+					
+					if (w(l) >= -0.005)
+						g[l] = max(g[l], 0.0);
+				}
+			}
+			
+			shrink(w, margins);
+		}
+		
+		return 0.5 * maxNorm * maxNorm + C_ * loss;
+	}
+	
+	// Shrinks the negatives inactive for the last ShrinkIterations gradient evaluations. A shrunk
+	// negative stays inactive as long as the distance to the reference solution is less than its
+	// slack, since its margin changes by at most its norm times the distance travelled
+	void shrink(const VectorXd & w, const vector<VectorXf> & margins) const
+	{
+		if (!reference_.size())
+			reference_ = w;
+		
+		const double distance = (w - reference_).norm();
+		
+		bool shrunk = false;
+		
+		for (int i = 0; i < negatives_.size(); ++i) {
+			if (shrunk_[i])
+				continue;
+			
+			const double margin = margins[negatives_[i].first](negatives_[i].second);
+			
+			if (margin > -1.0) {
+				inactive_[i] = 0;
+			}
+			else if (++inactive_[i] >= ShrinkIterations) {
+				slacks_[i] = (-1.0 - margin) / norms_[i] - distance;
+				
+				if (slacks_[i] > distance) {
+					shrunk_[i] = true;
+					shrunk = true;
+				}
+			}
+		}
+		
+		if (shrunk)
+			makeBlocks();
+	}
+	
+	// Computes the margins of the shrunk negatives, and makes w the reference solution
+	void check(const VectorXd & w) const
+	{
+		const VectorXf wf = w.cast<float>();
+		
+		#pragma omp parallel for
+		for (int i = 0; i < negatives_.size(); ++i) {
+			if (shrunk_[i]) {
+				const int model = negatives_[i].first;
+				const float margin = samples_[model].row(negatives_[i].second).dot(
+										 wf.segment(offsets_[model], samples_[model].cols()));
+				
+				slacks_[i] = (-1.0 - margin) / norms_[i];
+			}
+		}
+		
+		reference_ = w;
+	}
+	
+	// Returns the smallest slack of the shrunk negatives
+	double minSlack() const
+	{
+		double slack = numeric_limits<double>::infinity();
+		
+		for (int i = 0; i < negatives_.size(); ++i)
+			if (shrunk_[i])
+				slack = std::min(slack, slacks_[i]);
+		
+		return slack;
+	}
+	
+	// Brings back the shrunk negatives whose slack is at most the distance to the reference
+	// solution, and computes their projections on the current direction if needed
+	void reactivate(double distance, bool projections) const
+	{
+		bool reactivated = false;
+		
+		for (int i = 0; i < negatives_.size(); ++i) {
+			if (shrunk_[i] && (slacks_[i] <= distance)) {
+				shrunk_[i] = false;
+				inactive_[i] = 0;
+				reactivated = true;
+				
+				if (projections) {
+					const int model = negatives_[i].first;
+					const int row = negatives_[i].second;
+					
+					project(model, row);
+					projections_[model](row, 2) = projections_[model](row, 1) +
+												  constrained_[model].row(row).dot(
+													  constrainedValues(z_, model));
+				}
+			}
+		}
+		
+		if (reactivated)
+			makeBlocks();
+	}
+	
+	// Lists the active rows of each model, in order, and splits them in blocks shared between the
+	// threads
+	void makeBlocks() const
+	{
+		const int blockSize = 256; // Number of rows per block
+		
+		vector<vector<bool> > active(models_.size());
+		
+		for (int i = 0; i < models_.size(); ++i)
+			active[i].resize(samples_[i].rows(), true);
+		
+		for (int i = 0; i < negatives_.size(); ++i)
+			if (shrunk_[i])
+				active[negatives_[i].first][negatives_[i].second] = false;
+		
+		blocks_.clear();
+		
+		for (int i = 0; i < models_.size(); ++i) {
+			rows_[i].clear();
+			
+			for (int j = 0; j < active[i].size(); ++j)
+				if (active[i][j])
+					rows_[i].push_back(j);
+			
+			const int nbRows = static_cast<int>(rows_[i].size());
+			
+			for (int j = 0; j < nbRows; j += blockSize)
+				blocks_.push_back(Vector3i(i, j, min(blockSize, nbRows - j)));
+		}
+	}
+	
+	// Number of gradient evaluations after which an inactive negative is shrunk, and number of
+	// line-searches between two checks of the shrunk negatives
+	static const int ShrinkIterations = 5;
+	static const int CheckIterations = 10;
+	
+	// Scale of the bias feature and maximum number of updates of the distribution over the
+	// components in the dual coordinate descent
+	static const int BiasScale = 10;
+	static const int MaxDistributionIterations = 20;
+	
 	vector<Model> & models_;
-	const vector<pair<Model, int> > & positives_;
-	const vector<pair<Model, int> > & negatives_;
 	double C_;
 	double J_;
 	int maxIterations_;
+	vector<int> offsets_; // Offset of the parameters of each model in x, and their total number
+	vector<vector<int> > deformations_; // Offset of the deformation of each part in its model
+	vector<vector<int> > constraints_; // Offset of each constrained coefficient in its model
+	vector<GSHOTPyramid::Matrix> samples_; // Samples of each model, one per row
+	vector<GSHOTPyramid::Matrix> constrained_; // Constrained columns of the samples
+	vector<pair<int, int> > positives_; // Model and row of each positive
+	vector<pair<int, int> > negatives_; // Model and row of each negative
+	vector<double> norms_; // Norm of each negative
+	
+	// State of the shrinking
+	mutable vector<vector<int> > rows_; // Active rows of each model
+	mutable vector<Vector3i> blocks_; // Model, first index in rows_ and number of rows of a block
+	mutable vector<bool> shrunk_; // Whether each negative is shrunk
+	mutable vector<double> slacks_; // Distance to the reference each shrunk negative can go
+	mutable vector<int> inactive_; // Number of gradient evaluations each negative was inactive
+	mutable VectorXd reference_; // Reference solution, empty until the first shrinking
+	mutable int nbDirections_;
+	
+	// State of the current line search
+	mutable VectorXd x_; // Solution
+	mutable VectorXd z_; // Direction
+	mutable Matrix<float, Dynamic, 2> xz_; // Solution and direction without the constraints
+	mutable double radius_; // Distance of the solution to the reference solution
+	mutable double zNorm_; // Norm of the direction
+	mutable double maxStep_; // Step up to which the shrunk negatives are inactive
+	mutable vector<Matrix<float, Dynamic, 3> > projections_; // Samples on x, z and whole z
 };}
 }
 
 double Mixture::trainSVM(const vector<pair<Model, int> > & positives,
 					  const vector<pair<Model, int> > & negatives, double C, double J,
-					  int maxIterations)
+					  int maxIterations, Solver solver)
 {
 
 	detail::Loss loss(models_, positives, negatives, C, J, maxIterations);
 
-    double epsilon = 0.001;
-    LBFGS lbfgs(&loss, epsilon, maxIterations, 20, 20);
-
-	
-	// Start from the current models
 	VectorXd x(loss.dim());
 	
-	detail::Loss::FromModels(models_, x.data());
-
-	const double l = lbfgs(x.data());
+	double l;
+	
+	if (solver == DUAL_COORDINATE_DESCENT) {
+		// Start from zero, with the stopping tolerance of the projected gradients
+		l = loss.solveDual(x.data(), 0.01, maxIterations);
+	}
+	else {
+		double epsilon = 0.001;
+		LBFGS lbfgs(&loss, epsilon, maxIterations, 20, 20);
+		
+		// Start from the current models
+		detail::Loss::FromModels(models_, x.data());
+		
+		l = lbfgs(x.data());
+	}
 
 	detail::Loss::ToModels(x.data(), models_);
 
+	// The filters changed
+	cached_ = false;
+
 	return l;
 }
 
 void Mixture::convolve(const GSHOTPyramid & pyramid,
-                       vector<vector<vector<Tensor3DF> > > & scores,//[model][lvl][box]
-                       vector<vector<vector<vector<Model::Positions> > > > * positions) const//[model.size][model.part.size][pyramid.lvl.size][box]
+                       vector<vector<Tensor3DPackF> > & scores,//[model][lvl][box]
+                       vector<vector<vector<Model::LevelPositions> > > * positions) const//[model.size][model.part.size][pyramid.lvl.size][box]
 {
 
 	if (empty() || pyramid.empty()) {
@@ -1137,13 +1835,68 @@ void Mixture::convolve(const GSHOTPyramid & pyramid,
 	if (positions)
 		positions->resize(nbModels);
 	
-	// Transform the filters if needed
+	vector<vector<vector<Tensor3DF> > > convolutions;//[filter][lvl][box]
 
-//#pragma omp parallel for
-    for (int i = 0; i < nbModels; ++i){
-        models_[i].convolve(pyramid, scores[i], positions ? &(*positions)[i] : 0);
-    }
+#ifndef FFLD_MIXTURE_STANDARD_CONVOLUTION
+	const Patchwork patchwork(pyramid);
+
+	// Transform the filters if needed, then convolve the patchwork with them (the transforms are
+	// completed for new box sizes, so the cache stays locked while in use)
+#pragma omp critical(MixtureFilterCache)
+	{
+		if (!cached_)
+			cacheFilters();
+
+		patchwork.transformFilters(filterCache_);
+		patchwork.convolve(filterCache_, convolutions);
+	}
+#else
+	// Stack the root and part filters of all the models in a single bank, the pyramid applies all
+	// the filters of the same size with one matrix product per box, so each level is read once
+	// instead of once per model
+	vector<const GSHOTPyramid::Level *> filters;
+
+	for (int i = 0; i < nbModels; ++i)
+		for (int j = 0; j < models_[i].parts().size(); ++j)
+			filters.push_back(&models_[i].parts()[j].filter);
+
+	pyramid.convolve(filters, convolutions);
+#endif
+
+	// Give each model its own convolutions (in the order of the filter bank), they are moved
+	// rather than copied as the models transform them in place
+	int offset = 0;
+
+	for (int i = 0; i < nbModels; ++i) {
+		const int nbFilters = static_cast<int>(models_[i].parts().size());
+
+		vector<vector<vector<Tensor3DF> > > modelConvolutions(nbFilters);
+
+		for (int j = 0; j < nbFilters; ++j)
+			modelConvolutions[j].swap(convolutions[offset + j]);
+
+		models_[i].convolve(pyramid, scores[i], positions ? &(*positions)[i] : 0, &modelConvolutions);
+
+		offset += nbFilters;
+	}
+}
+
+void Mixture::cacheFilters() const
+{
+	// Count the number of filters
+	int nbFilters = 0;
+
+	for (int i = 0; i < models_.size(); ++i)
+		nbFilters += models_[i].parts().size();
+
+	// Transform all the filters
+	filterCache_.resize(nbFilters);
+
+	for (int i = 0, j = 0; i < models_.size(); ++i)
+		for (int k = 0; k < models_[i].parts().size(); ++k, ++j)
+			Patchwork::TransformFilter(models_[i].parts()[k].filter, filterCache_[j]);
 
+	cached_ = true;
 }
 
 Matrix3f Mixture::getRotation(Vector4f orientationFrom, Vector4f orientationTo){
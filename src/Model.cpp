@@ -153,18 +153,7 @@ void Model::initializeParts(int nbParts, Eigen::Vector3i partSize, GSHOTPyramid:
 
 
     // Compute the energy of each cell
-    Tensor3DF energy(root2x.depths(), root2x.rows(), root2x.cols());
-
-    for (int z = 0; z < root2x.depths(); ++z) {
-        for (int y = 0; y < root2x.rows(); ++y) {
-            for (int x = 0; x < root2x.cols(); ++x) {
-                energy()(z, y, x) = 0;
-
-                for (int i = 0; i < GSHOTPyramid::DescriptorSize; ++i)
-                    energy()(z, y, x) += root2x()(z, y, x).coeff(i) * root2x()(z, y, x).coeff(i);
-            }
-        }
-    }
+    Tensor3DF energy = root2x.cellSquaredNorms();
 
     // Assign each part greedily to the region of maximum energy
     parts_.resize(nbParts + 1);
@@ -184,7 +173,7 @@ void Model::initializeParts(int nbParts, Eigen::Vector3i partSize, GSHOTPyramid:
         for (int z = 0; z <= energy.depths() - partSize(0); ++z) {
             for (int y = 0; y <= energy.rows() - partSize(1); ++y) {
                 for (int x = 0; x <= energy.cols() - partSize(2); ++x) {
-                    const double e = energy.block(z, y, x, partSize(0), partSize(1), partSize(2)).sum();
+                    const double e = energy.blockView(z, y, x, partSize(0), partSize(1), partSize(2)).sum();
 
                     if (e > maxEnergy) {
                         maxEnergy = e;
@@ -197,7 +186,7 @@ void Model::initializeParts(int nbParts, Eigen::Vector3i partSize, GSHOTPyramid:
         }
 
         // Initialize the part
-        parts_[i + 1].filter = root2x.block(argZ, argY, argX, partSize(0), partSize(1), partSize(2));
+        parts_[i + 1].filter = root2x.blockView(argZ, argY, argX, partSize(0), partSize(1), partSize(2)).copy();
         parts_[i + 1].offset(0) = argZ;
         parts_[i + 1].offset(1) = argY;
         parts_[i + 1].offset(2) = argX;
@@ -205,7 +194,7 @@ void Model::initializeParts(int nbParts, Eigen::Vector3i partSize, GSHOTPyramid:
         cout<<"Model::initializeParts init part 1 : offset["<<i+1<<"] = "<< parts_[i+1].offset <<endl;
 
         // Set the energy of the part to zero
-        energy.blockLink(argZ, argY, argX, partSize(0), partSize(1), partSize(2)).setZero();
+        energy.blockView(argZ, argY, argX, partSize(0), partSize(1), partSize(2)).setZero();
     }
 ////////////
 //    // Retry 10 times from randomized starting points
@@ -327,7 +316,7 @@ void Model::initializeParts(int nbParts, Eigen::Vector3i partSize, GSHOTPyramid:
 
 
 void Model::initializeSample(const GSHOTPyramid & pyramid, int box, int z, int y, int x, int lvl, Model & sample,
-                             const vector<vector<vector<Positions> > > *positions) const
+                             const vector<vector<LevelPositions> > *positions) const
 {
 //    cout << "initializeSample ..." << endl;
     // All the constants relative to the model and the pyramid
@@ -381,19 +370,27 @@ void Model::initializeSample(const GSHOTPyramid & pyramid, int box, int z, int y
 //    #pragma omp parallel for
     for (int i = 0; i < nbParts; ++i) {
         // Position of the part
-        if ((lvl >= (*positions)[i].size()) || (x >= (*positions)[i][lvl][box].cols()) ||
+        if ((lvl >= (*positions)[i].size()) || (box >= (*positions)[i][lvl].size()) ||
+            (x >= (*positions)[i][lvl][box].cols()) ||
             (y >= (*positions)[i][lvl][box].rows()) || (z >= (*positions)[i][lvl][box].depths())) {
             sample = Model();
             cerr << "Attempting to initialize an empty sample 2" << endl;
             cerr << "lvl : "<<lvl<<" >= "<<(*positions)[i].size()<< endl;
-            cerr << "x : "<<x<<" >= "<<(*positions)[i][lvl][box].cols()<< endl;
-            cerr << "y : "<<y<<" >= "<<(*positions)[i][lvl][box].rows()<< endl;
-            cerr << "z : "<<z<<" >= "<<(*positions)[i][lvl][box].depths()<< endl;
+
+            if (lvl < (*positions)[i].size()) {
+                cerr << "box : "<<box<<" >= "<<(*positions)[i][lvl].size()<< endl;
+
+                if (box < (*positions)[i][lvl].size()) {
+                    cerr << "x : "<<x<<" >= "<<(*positions)[i][lvl][box].cols()<< endl;
+                    cerr << "y : "<<y<<" >= "<<(*positions)[i][lvl][box].rows()<< endl;
+                    cerr << "z : "<<z<<" >= "<<(*positions)[i][lvl][box].depths()<< endl;
+                }
+            }
 
             return;
         }
 		
-        const Position position = (*positions)[i][lvl][box]()(z, y, x);
+        const Position position = (*positions)[i][lvl][box](z, y, x);
 		
         // Level of the part
         if ((position(3) < 0) || (position(3) >= nbLevels)) {
@@ -428,8 +425,8 @@ void Model::initializeSample(const GSHOTPyramid & pyramid, int box, int z, int y
 //                                partSize().third)).isZero()<<endl;
 
         // Extract the part filter
-        sample.parts_[i + 1].filter = level.block(position(0), position(1), position(2), partSize()(0),
-                                                  partSize()(1), partSize()(2));
+        sample.parts_[i + 1].filter = level.blockView(position(0), position(1), position(2), partSize()(0),
+                                                      partSize()(1), partSize()(2)).copy();
 		
         // Set the part offset to the position
         sample.parts_[i + 1].offset = position;
@@ -437,25 +434,26 @@ void Model::initializeSample(const GSHOTPyramid & pyramid, int box, int z, int y
 //        cout<<"Model::InitiSample filter part position = "<<position<<endl;
 
 		
-        // Compute the deformation gradient at the level of the part
+        // Compute the deformation gradient at the level of the part, from the anchor rounded to a
+        // cell of that level as in convolve (exact one octave below the root)
         const double scale = pow(2.0, static_cast<double>(lvl - position(3)) / interval);
-        const double xr = (x + (parts_[i + 1].offset(2) + partSize()(2) * 0.5) * 0.5 /*- pad.x()*/) *
-                          scale + /*pad.x()*/ - partSize()(2) * 0.5;
-        const double yr = (y + (parts_[i + 1].offset(1) + partSize()(1) * 0.5) * 0.5 /*- pad.y()*/) *
-                          scale + /*pad.y()*/ - partSize()(1) * 0.5;
-        const double zr = (z + (parts_[i + 1].offset(0) + partSize()(0) * 0.5) * 0.5 /*- pad.z()*/) *
-                          scale + /*pad.z()*/ - partSize()(0) * 0.5;
+        const double xr = floor((x + (parts_[i + 1].offset(2) + partSize()(2) * 0.5) * 0.5 /*- pad.x()*/) *
+                                scale + /*pad.x()*/ - partSize()(2) * 0.5 + 0.5);
+        const double yr = floor((y + (parts_[i + 1].offset(1) + partSize()(1) * 0.5) * 0.5 /*- pad.y()*/) *
+                                scale + /*pad.y()*/ - partSize()(1) * 0.5 + 0.5);
+        const double zr = floor((z + (parts_[i + 1].offset(0) + partSize()(0) * 0.5) * 0.5 /*- pad.z()*/) *
+                                scale + /*pad.z()*/ - partSize()(0) * 0.5 + 0.5);
         const double dx = xr - position(2);
         const double dy = yr - position(1);
         const double dz = zr - position(0);
         const int dlvl = lvl - interval - position(3);
 		
-        sample.parts_[i + 1].deformation(0) = dz * dz;
-        sample.parts_[i + 1].deformation(1) = dz;
+        sample.parts_[i + 1].deformation(0) = dx * dx;
+        sample.parts_[i + 1].deformation(1) = dx;
         sample.parts_[i + 1].deformation(2) = dy * dy;
         sample.parts_[i + 1].deformation(3) = dy;
-        sample.parts_[i + 1].deformation(4) = dx * dx;
-        sample.parts_[i + 1].deformation(5) = dx;
+        sample.parts_[i + 1].deformation(4) = dz * dz;
+        sample.parts_[i + 1].deformation(5) = dz;
         sample.parts_[i + 1].deformation(6) = dlvl * dlvl;
         sample.parts_[i + 1].deformation(7) = dlvl;
     }
@@ -463,8 +461,19 @@ void Model::initializeSample(const GSHOTPyramid & pyramid, int box, int z, int y
     sample.bias_ = 1.0;
 }
 
-void Model::convolve(const GSHOTPyramid & pyramid, vector<vector<Tensor3DF> > &scores,//[lvl][box]
-                     vector<vector<vector<Positions> > >* positions,//[part][lvl][box]
+// Sizes (depths, rows, cols) of a list of tensors
+static vector<Vector3i> TensorSizes(const vector<Tensor3DF> & tensors)
+{
+    vector<Vector3i> sizes(tensors.size());
+
+    for (int i = 0; i < tensors.size(); ++i)
+        sizes[i] << tensors[i].depths(), tensors[i].rows(), tensors[i].cols();
+
+    return sizes;
+}
+
+void Model::convolve(const GSHOTPyramid & pyramid, vector<Tensor3DPackF> &scores,//[lvl][box]
+                     vector<vector<LevelPositions> >* positions,//[part][lvl][box]
                      vector<vector<vector<Tensor3DF> > > * convolutions/*useless*/) const
 {
 
@@ -512,171 +521,209 @@ void Model::convolve(const GSHOTPyramid & pyramid, vector<vector<Tensor3DF> > &s
 		
         cout<<"Model::convolve ..."<<endl;
 
-//        #pragma omp parallel for
+        // All the filters of a box are applied by the same matrix product
+        vector<const GSHOTPyramid::Level *> filters(nbFilters);
         for (int i = 0; i < nbFilters; ++i){
-
-            pyramid.convolve(parts_[i].filter, tmpConvolutions[i]);
-//            cout<<"Model::convolve pyramid convolution results of size : "<< tmpConvolutions.size()
-//               << " / " << tmpConvolutions[i].size() << " / " << tmpConvolutions[i][0].size()<<endl;
-//            cout<<"Model::convolve tmpConvolutions["<<i<<"][0].isZero() : "<< tmpConvolutions[i][0].isZero()<<endl;
-//            cout<<"Model::convolve tmpConvolutions["<<i<<"][1].isZero() : "<< tmpConvolutions[i][1].isZero()<<endl;
-
+            filters[i] = &parts_[i].filter;
         }
 
+        pyramid.convolve(filters, tmpConvolutions);
+
         convolutions = &tmpConvolutions;//[part][lvl][box]
 	}
 	
-    // Resize the positions
+    // The scores start as the root convolutions, in one buffer per level. Only the levels with
+    // parts one octave below are scored
+    scores.resize(nbLevels);
+
+    for (int lvl = 0; lvl < nbLevels; ++lvl) {
+        const vector<Tensor3DF> & rootConvolutions = (*convolutions)[0][lvl];
+
+        scores[lvl].resize(lvl >= interval ? TensorSizes(rootConvolutions) :
+                                             vector<Vector3i>(rootConvolutions.size(), Vector3i::Zero()));
+
+        for (int box = 0; box < scores[lvl].size(); ++box)
+            copy(rootConvolutions[box]().data(), rootConvolutions[box]().data() + scores[lvl][box].size(),
+                 scores[lvl].data() + scores[lvl].offset(box));
+    }
+
+    // Levels of the parts around the one octave below the root. With FFLD_MODEL_3D the parts can
+    // also move by up to an octave across scales, at the cost of deformation(6) and (7)
+#ifdef FFLD_MODEL_3D
+    const int window = interval;
+#else
+    const int window = 0;
+#endif
+
     if (positions) {
         cout<<"Model::convolve resize positions"<<endl;
 
         positions->resize(nbParts);
-		
+
         for (int i = 0; i < nbParts; ++i){
             (*positions)[i].resize(nbLevels);
-            for (int j = 0; j < pyramid.levels().size(); ++j){
-                (*positions)[i][j].resize(pyramid.levels()[j].size());
+
+            for (int lvl = 0; lvl < nbLevels; ++lvl){
+                (*positions)[i][lvl].resizeLike(scores[lvl]);
+                (*positions)[i][lvl].setConstant(Position::Zero());
             }
         }
     }
-	
-    // Temporary data needed by the distance transforms
-    Tensor3DF tmp1;
-    Tensor3DF tmp2;
 
+    // Sizes of the temporary data needed by the distance transforms
+    int maxSize = 0;
+    int maxDim = 0;
 
-    float sum = 0.0;
+    for (int i = 0; i < nbParts; ++i) {
+        for (int lvl = 0; lvl < nbLevels; ++lvl) {
+            for (int box = 0; box < (*convolutions)[i + 1][lvl].size(); ++box) {
+                const Tensor3DF & partScores = (*convolutions)[i + 1][lvl][box];
 
-    // For each root level in reverse order
-    #pragma omp parallel for
-    for (int lvl = nbLevels - 1; lvl >= interval; --lvl) {
+                maxSize = max(maxSize, partScores.size());
+                maxDim = max(maxDim, max(partScores.depths(), max(partScores.rows(), partScores.cols())));
+            }
+        }
+    }
 
-//        if((*convolutions)[0][lvl - interval].size() > 0){
-//            stringstream name;
-//            name << "conv" << 0 << ".txt";
-//            ofstream out(name.str().c_str());
-//            out << (*convolutions)[0][lvl]();
-//        }
-        #pragma omp parallel for
-        for (int box = 0; box < pyramid.levels()[lvl].size(); ++box){
-//            cout<<"Model::conv score start : "<<(*convolutions)[0][lvl][box]()(0,0,0)<<endl;
+    // The root levels are scored in order, streaming over the part levels: a part level is
+    // transformed when it enters the window of the root level and released when it leaves it, so
+    // that only the distance transforms (and their positions) of a window are held at once
+    vector<vector<LevelPositions> > dtPositions(nbParts, vector<LevelPositions>(nbLevels));
+    int nbTransformed = 0;
 
-            // For each part
-            #pragma omp parallel for
+    for (int lvl = interval; lvl < nbLevels; ++lvl) {
+        const int anchor = lvl - interval;
+        const int first = max(0, anchor - window);
+        const int last = min(nbLevels - 1, anchor + window);
+
+        // The (part, level, box) of the part levels entering the window, each transformed
+        // independently
+        vector<Vector3i> transforms;
+
+        for (; nbTransformed <= last; ++nbTransformed) {
             for (int i = 0; i < nbParts; ++i) {
+                if (positions)
+                    dtPositions[i][nbTransformed].resize(TensorSizes((*convolutions)[i + 1][nbTransformed]));
 
+                for (int box = 0; box < (*convolutions)[i + 1][nbTransformed].size(); ++box)
+                    transforms.push_back(Vector3i(i, nbTransformed, box));
+            }
+        }
 
-                // Transform the part one octave below
+        // With fewer transforms than threads the distance transforms split their own lines across
+        // threads
+        #pragma omp parallel if (transforms.size() >= omp_get_max_threads())
+        {
+            // Temporary data needed by the distance transforms, one per thread
+            DTWorkspace workspace;
+            workspace.reserve(maxSize, maxDim);
+
+            #pragma omp for schedule(dynamic)
+            for (int j = 0; j < transforms.size(); ++j) {
+                const int i = transforms[j](0);
+                const int partLvl = transforms[j](1);
+                const int box = transforms[j](2);
+                Tensor3DF & partScores = (*convolutions)[i + 1][partLvl][box];
+
+                DT3D(partScores, parts_[i + 1], workspace,
+                     positions ? dtPositions[i][partLvl].data() + dtPositions[i][partLvl].offset(box) : 0);
+            }
+        }
 
-    //            sum = (*convolutions)[i+1][lvl - interval].sum();
-    //            cout<<"Model::conv sum for part "<<i+1<<" before DT3D : "<<sum<<endl;
+        // Scales from the part levels to the root level
+        vector<double> scales(last - first + 1);
 
-                DT3D((*convolutions)[i + 1][lvl - interval][box], parts_[i + 1], tmp1, tmp2,
-                     positions ? &(*positions)[i][lvl - interval][box] : 0);
+        for (int partLvl = first; partLvl <= last; ++partLvl)
+            scales[partLvl - first] = pow(2.0, static_cast<double>(lvl - partLvl) / interval);
 
-                if (positions){
-                    (*positions)[i][lvl][box] = Positions((*convolutions)[0][lvl][box].depths(),
-                                                     (*convolutions)[0][lvl][box].rows(),
-                                                     (*convolutions)[0][lvl][box].cols());
-                    (*positions)[i][lvl][box]().setConstant( Position::Zero());
-                }
+        // Add the best distance transform of each part across the window. The parts of a box add
+        // to the same scores so they stay in the same iteration
+        #pragma omp parallel for schedule(dynamic)
+        for (int box = 0; box < scores[lvl].size(); ++box) {
+            const Tensor3DView<GSHOTPyramid::Scalar> score = scores[lvl][box];
+
+            // For each part
+            for (int i = 0; i < nbParts; ++i) {
+                const Part & part = parts_[i + 1];
+                const Vector3i partSize(part.filter.depths(), part.filter.rows(), part.filter.cols());
+
+                for (int z = 0; z < score.depths(); ++z) {
+                    for (int y = 0; y < score.rows(); ++y) {
+                        for (int x = 0; x < score.cols(); ++x) {
+                            GSHOTPyramid::Scalar best = -numeric_limits<GSHOTPyramid::Scalar>::infinity();
+                            Position bestPosition = Position::Zero();
+
+                            for (int partLvl = first; partLvl <= last; ++partLvl) {
+                                const Tensor3DF & partScores = (*convolutions)[i + 1][partLvl][box];
+                                int zr, yr, xr;
+
+                                if (partLvl == anchor) {
+                                    zr = 2 * z/*- pad.z()*/ + part.offset(0);//coord lvl - interval 0
+                                    yr = 2 * y /*- pad.y()*/ + part.offset(1);
+                                    xr = 2 * x /*- pad.x()*/ + part.offset(2);
+                                }
+                                else {
+                                    // Same anchor as in initializeSample, rescaled to the level
+                                    const double scale = scales[partLvl - first];
+
+                                    zr = static_cast<int>(floor((z + (part.offset(0) + partSize(0) * 0.5) * 0.5) *
+                                                                scale - partSize(0) * 0.5 + 0.5));
+                                    yr = static_cast<int>(floor((y + (part.offset(1) + partSize(1) * 0.5) * 0.5) *
+                                                                scale - partSize(1) * 0.5 + 0.5));
+                                    xr = static_cast<int>(floor((x + (part.offset(2) + partSize(2) * 0.5) * 0.5) *
+                                                                scale - partSize(2) * 0.5 + 0.5));
+                                }
 
-    //            sum = (*convolutions)[i+1][lvl - interval].sum();
-    //            cout<<"Model::conv sum for part "<<i+1<<" after DT3D : "<<sum<<endl;
+                                if ((xr >= 0) && (yr >= 0) && (zr >= 0) &&
+                                    (xr < partScores.cols()) &&//lvl - interval 0
+                                    (yr < partScores.rows()) &&
+                                    (zr < partScores.depths())) {
 
-                if((*convolutions)[i+1][lvl - interval][box].size() > 0 && box == 403){
-                    stringstream name;
-                    name << "conv" << i+1 << ".txt";
-                    ofstream out(name.str().c_str());
-                    out << (*convolutions)[i+1][lvl - interval][box]();
-                }
+                                    const int dlvl = anchor - partLvl;
+                                    const GSHOTPyramid::Scalar value = partScores()(zr, yr, xr) +
+                                        (part.deformation(6) * dlvl + part.deformation(7)) * dlvl;
+
+                                    if (value > best) {
+                                        best = value;
 
-                // Add the distance transforms of the part one octave below
-                for (int z = 0; z < (*convolutions)[0][lvl][box].depths(); ++z) {//lvl=1
-                    for (int y = 0; y < (*convolutions)[0][lvl][box].rows(); ++y) {
-                        for (int x = 0; x < (*convolutions)[0][lvl][box].cols(); ++x) {
-
-                            const int zr = 2 * z/*- pad.z()*/ + parts_[i + 1].offset(0);//coord lvl - interval 0
-                            const int yr = 2 * y /*- pad.y()*/ + parts_[i + 1].offset(1);
-                            const int xr = 2 * x /*- pad.x()*/ + parts_[i + 1].offset(2);
-
-                            if ((xr >= 0) && (yr >= 0) && (zr >= 0) &&
-                                (xr < (*convolutions)[i + 1][lvl - interval][box].cols()) &&//lvl - interval 0
-                                (yr < (*convolutions)[i + 1][lvl - interval][box].rows()) &&
-                                (zr < (*convolutions)[i + 1][lvl - interval][box].depths())) {
-
-                                (*convolutions)[0][lvl][box]()(z, y, x) += (*convolutions)[i + 1][lvl - interval][box]()(zr, yr, xr);
-//                                cout<<"Model::conv score : "<<(*convolutions)[0][lvl][box]()(0,0,0)<<endl;
-
-                                if (positions){
-                                    (*positions)[i][lvl][box]()(z, y, x) <<
-                                        (*positions)[i][lvl - interval][box]()(zr, yr, xr)(0),
-                                        (*positions)[i][lvl - interval][box]()(zr, yr, xr)(1),
-                                        (*positions)[i][lvl - interval][box]()(zr, yr, xr)(2),
-                                        lvl - interval;
-//                                    cout<<"Model::(*positions)[i][lvl - interval][box]()(zr, yr, xr) "<<(*positions)[i][lvl - interval][box]()(zr, yr, xr)<<endl;
+                                        if (positions) {
+                                            const Position & dtPosition = dtPositions[i][partLvl][box](zr, yr, xr);
+
+                                            bestPosition << dtPosition(0), dtPosition(1), dtPosition(2), partLvl;
+                                        }
+                                    }
                                 }
                             }
-                            else {
-    //                            cout<<"Model::conv set score to -inf ..."<<endl;
-    //                            cout<<"Model::conv "<<zr<<" < "<<(*convolutions)[i + 1][lvl - interval].depths()<<endl;
-    //                            cout<<"Model::conv "<<yr<<" < "<<(*convolutions)[i + 1][lvl - interval].rows()<<endl;
-    //                            cout<<"Model::conv "<<xr<<" < "<<(*convolutions)[i + 1][lvl - interval].cols()<<endl;
 
-                                (*convolutions)[0][lvl][box]()(z, y, x) =
-                                    -numeric_limits<GSHOTPyramid::Scalar>::infinity();
+                            if (best > -numeric_limits<GSHOTPyramid::Scalar>::infinity()) {
+                                score(z, y, x) += best;
+
+                                if (positions)
+                                    (*positions)[i][lvl][box](z, y, x) = bestPosition;
+                            }
+                            else {
+                                score(z, y, x) = -numeric_limits<GSHOTPyramid::Scalar>::infinity();
                             }
                         }
                     }
                 }
-                if (positions)
-                    (*positions)[i][lvl - interval][box] = Positions();
-
-
             }
-//            cout<<"Model::conv score end : "<<(*convolutions)[0][lvl][box]()(0,0,0)<<endl;
-//            (*convolutions)[0][lvl][box]()(0,0,0) /=  nbFilters;
-//            cout<<"Model::conv score final : "<<(*convolutions)[0][lvl][box]()(0,0,0)<<endl;
-
         }
 
-    }
-
-    scores.swap((*convolutions)[0]);
-
-    #pragma omp parallel for
-    for (int i = 0; i < interval; ++i) {
-        #pragma omp parallel for
-        for (int box = 0; box < pyramid.levels()[0].size(); ++box){
-
-            scores[i][box] = Tensor3DF();
-
-            for (int j = 0; j < nbParts; ++j){
-                (*positions)[j][i][box] = Positions();
+        // Release the part level leaving the window
+        if (first == anchor - window) {
+            for (int i = 0; i < nbParts; ++i) {
+                vector<Tensor3DF>(0).swap((*convolutions)[i + 1][first]);
+                dtPositions[i][first].clear();
             }
         }
     }
 
-//    float den = 1.0/nbFilters;
-//    cout<<"Model::conv den : "<<den<<" / nbFilters : "<<nbFilters<<endl;
-//    scores[1] *= den;
-
 //     Add the bias if necessary
     if (bias_) {
-        #pragma omp parallel for
-        for (int i = interval; i < nbLevels; ++i){
-            #pragma omp parallel for
-            for (int box = 0; box < pyramid.levels()[0].size(); ++box){
-
-    //			scores[i].array() += bias_;
-                Tensor3DF biasTensor( scores[i][box].depths(), scores[i][box].rows(), scores[i][box].cols());
-                biasTensor().setConstant( bias_);
-                scores[i][box]() += biasTensor();
-//                scores[i][box]()(0,0,0) /=  nbFilters;
-            }
-        }
+        for (int lvl = interval; lvl < nbLevels; ++lvl)
+            Map<ArrayXf>(scores[lvl].data(), scores[lvl].nbElements()) += bias_;
     }
-
 }
 
 double Model::dot(const Model & sample) const
@@ -706,15 +753,7 @@ double Model::dot(const Model & sample) const
 //            d += f1()(0,0,0)(j) * f2()(0,0,0)(j);
 //        }
 
-        for (int z = 0; z < parts_[i].filter.depths(); ++z){
-            for (int y = 0; y < parts_[i].filter.rows(); ++y){
-                for (int x = 0; x < parts_[i].filter.cols(); ++x){
-                    for (int j = 0; j < GSHOTPyramid::DescriptorSize; ++j){
-                        d += parts_[i].filter()(z, y, x)(j) * sample.parts_[i].filter()(z, y, x)(j);
-                    }
-                }
-            }
-        }
+        d += parts_[i].filter.dot(sample.parts_[i].filter);
 
         if (i){
             for (int j = 0; j < parts_[i].deformation.size(); ++j){
@@ -729,12 +768,12 @@ double Model::dot(const Model & sample) const
 double Model::norm() const{
 
     if( parts_.size() < 1){
-        return sqrt( GSHOTPyramid::TensorMap(parts_[0].filter).squaredNorm());
+        return sqrt( parts_[0].filter.dot(parts_[0].filter));
     } else{
-        double n = GSHOTPyramid::TensorMap(parts_[0].filter).squaredNorm();
+        double n = parts_[0].filter.dot(parts_[0].filter);
 
         for (int i = 1; i < parts_.size(); ++i) {
-            n += GSHOTPyramid::TensorMap(parts_[i].filter).squaredNorm();
+            n += parts_[i].filter.dot(parts_[i].filter);
 
 
             for(int j = 0; j < parts_[i].deformation.size(); ++j){
@@ -746,49 +785,42 @@ double Model::norm() const{
 }
 
 Model & Model::operator+=(const Model & sample)
+{
+	return axpy(1, sample);
+}
+
+Model & Model::operator-=(const Model & sample)
+{
+	return axpy(-1, sample);
+}
+
+bool Model::isCompatible(const Model & sample) const
 {
 	if (parts_.size() != sample.parts_.size())
-		return *this;
-	
-	Model copy(*this);
+		return false;
 	
 	for (int i = 0; i < parts_.size(); ++i) {
         if ((parts_[i].filter.depths() != sample.parts_[i].filter.depths()) ||
             (parts_[i].filter.rows() != sample.parts_[i].filter.rows()) ||
-			(parts_[i].filter.cols() != sample.parts_[i].filter.cols())) {
-			*this = copy; // Restore the copy
-			return *this;
-		}
-		
-        parts_[i].filter() += sample.parts_[i].filter();
-		parts_[i].deformation += sample.parts_[i].deformation;
+            (parts_[i].filter.cols() != sample.parts_[i].filter.cols()) ||
+            (parts_[i].deformation.size() != sample.parts_[i].deformation.size()))
+			return false;
 	}
 	
-	bias_ += sample.bias_;
-	
-	return *this;
+	return true;
 }
 
-Model & Model::operator-=(const Model & sample)
+Model & Model::axpy(double a, const Model & sample)
 {
-	if (parts_.size() != sample.parts_.size())
+	if (!isCompatible(sample))
 		return *this;
 	
-	Model copy(*this);
-	
 	for (int i = 0; i < parts_.size(); ++i) {
-        if ((parts_[i].filter.depths() != sample.parts_[i].filter.depths()) ||
-            (parts_[i].filter.rows() != sample.parts_[i].filter.rows()) ||
-            (parts_[i].filter.cols() != sample.parts_[i].filter.cols())) {
-			*this = copy; // Restore the copy
-			return *this;
-		}
-		
-        parts_[i].filter() -= sample.parts_[i].filter();
-		parts_[i].deformation -= sample.parts_[i].deformation;
+        parts_[i].filter.axpy(a, sample.parts_[i].filter);
+		parts_[i].deformation += a * sample.parts_[i].deformation;
 	}
 	
-	bias_ -= sample.bias_;
+	bias_ += a * sample.bias_;
 	
 	return *this;
 }
@@ -796,15 +828,7 @@ Model & Model::operator-=(const Model & sample)
 Model & Model::operator*=(double a)
 {
     for (int i = 0; i < parts_.size(); ++i) {
-        for (int z = 0; z < parts_[i].filter.depths(); ++z){
-            for (int y = 0; y < parts_[i].filter.rows(); ++y){
-                for (int x = 0; x < parts_[i].filter.cols(); ++x){
-                    for (int j = 0; j < GSHOTPyramid::DescriptorSize; ++j){
-                        parts_[i].filter()(z, y, x)(j) *= a;
-                    }
-                }
-            }
-        }
+        parts_[i].filter.scale(a);
         parts_[i].deformation *= a;
     }
 
@@ -813,99 +837,81 @@ Model & Model::operator*=(double a)
     return *this;
 }
 
-// y = EDT result
-// m = positions
-// z = distance
-// off = offset used to shift the weight grid to the right location of the part disregard to the root location p
-template <typename Scalar>
-static void dt1d(const Scalar * f, int n, Scalar a, Scalar b, Scalar * z, int * v, Scalar * y,
-                 int * m, const Scalar * t, int incf, int incy, int incm, int off = 0, int weightSize = 10)
+namespace
 {
-    assert(f && (y || m));
-    assert(n > 0);
-    assert(a < 0);
-    assert(z && v);
-    assert(t);
-    assert(incf && incy && (m ? incm : true));
-
-
-    int start = std::max(0, off - weightSize);
-    int end = std::min(n, off + weightSize);
+// Minimum number of cells of a tensor for its distance transform to be split across threads
+const int DTParallelSize = 16384;
+}
 
-    z[0] =-numeric_limits<Scalar>::infinity();  //Locations of boundaries between parabolas
-    z[1] = numeric_limits<Scalar>::infinity();  //Locations of boundaries between parabolas
-    v[0] = 0;                                   //Locations of parabolas in lower envelope
+// Transforms nbLines lines of n elements inc apart, CellKernels::DTLanes lines at a time. Line i
+// starts at (i / group) * groupStride + (i % group) * lineStride, so that the consecutive lines
+// along y and z are contiguous in memory and a tile is gathered from a few cache lines
+// m = positions of the lines, 4 ints per element (one of the coordinates of Model::Position)
+// Must be called by all the threads of the enclosing parallel region
+static void dtLines(const GSHOTPyramid::Scalar * src, GSHOTPyramid::Scalar * dst, int * m,
+                    int nbLines, int group, int groupStride, int lineStride, int n, int inc,
+                    GSHOTPyramid::Scalar a, GSHOTPyramid::Scalar b, const GSHOTPyramid::Scalar * t,
+                    Model::DTWorkspace & workspace)
+{
+    const int L = CellKernels::DTLanes;
+    const int nbTiles = (nbLines + L - 1) / L;
 
-    // Use a lookup table to replace the division by (a * (q - v[k]))
-    int k = 0;                                  //Index of rightmost parabola in lower envelope
-    Scalar fvk = f[0];
+    GSHOTPyramid::Scalar * f = &workspace.lines[0];
+    GSHOTPyramid::Scalar * y = &workspace.transformed[0];
+    int * argmaxes = &workspace.argmaxes[0];
 
+    #pragma omp for schedule(static)
+    for (int tile = 0; tile < nbTiles; ++tile) {
+        const int nbLanes = min(L, nbLines - tile * L);
+        int offsets[L];
 
+        for (int l = 0; l < nbLanes; ++l) {
+            const int i = tile * L + l;
+            offsets[l] = (i / group) * groupStride + (i % group) * lineStride;
+        }
 
-    for (int q = 1; q < n;) {
-        const Scalar s = (f[q * incf] - fvk) * t[q - v[k]] + (q + v[k]) - b / a;
-        // result good only if b = 0
-//        const Scalar s = (f[q * incf] - fvk) * t[q - v[k]] / 2.0 + (q*q - v[k]*v[k]) / (2*(q - v[k])) - off
-//                - b * (q - v[k]) / a;
-//        const Scalar s = (x[q * incx] - xvk) * t[q - v[k]] + (q + v[k]) - off;
+        // The lanes past the last line are transformed too, fill them with zeros
+        for (int q = 0; q < n; ++q) {
+            for (int l = 0; l < nbLanes; ++l)
+                f[q * L + l] = src[offsets[l] + q * inc];
 
-        if (s <= z[k]) {
-            --k;
-            fvk = f[v[k] * incf];
+            for (int l = nbLanes; l < L; ++l)
+                f[q * L + l] = 0;
         }
-        else {
-            ++k;
-            v[k] = q;
-            z[k] = s;
-            z[k + 1] = numeric_limits<Scalar>::infinity();
-            fvk = f[q * incf];
-            ++q;
-        }
-    }
 
-    z[k + 1] = numeric_limits<Scalar>::infinity();
+        CellKernels::DistanceTransform(f, n, a, b, t, &workspace.distance[0], &workspace.index[0],
+                                       y, argmaxes);
 
-    if (y && m) {
-        for (int q = 0, k = 0; q < n; ++q) {
-            while (z[k + 1] < 2 * q)
-                ++k;
+        for (int q = 0; q < n; ++q) {
+            for (int l = 0; l < nbLanes; ++l) {
+                dst[offsets[l] + q * inc] = y[q * L + l];
 
-            y[q * incy] = f[v[k] * incf] + (a * (q - v[k]) + b) * (q - v[k]);
-            m[q * incm] = v[k];
-//            if(q >= start && q <= end)
-//                y[q * incy] = f[v[k] * incf] + (a * (q - v[k] + off) + b) * (q - v[k] + off);
-//            else
-//                y[q * incy] = 0;//f[v[k] * incf];
-//            m[q * incm] = v[k] ;
+                if (m)
+                    m[4 * (offsets[l] + q * inc)] = argmaxes[q * L + l];
+            }
         }
     }
-    else if (y) {
-        for (int q = 0, k = 0; q < n; ++q) {
-            while (z[k + 1] < 2 * q)
-                ++k;
-
-            y[q * incy] = f[v[k] * incf] + (a * (q - v[k]) + b) * (q - v[k]);
-//            if(q >= start && q <= end)
-//                y[q * incy] = f[v[k] * incf] + (a * (q - v[k] + off) + b) * (q - v[k] + off);
-//            else
-//                y[q * incy] = 0;//f[v[k] * incf];
-        }
+}
+
+// Tensor = convolution score of the parts in the scene
+void Model::DTWorkspace::reserve(int size, int maxDim)
+{
+    if (tmp1.size() < size) {
+        tmp1.resize(size);
+        tmp2.resize(size);
     }
-    else {
-        for (int q = 0, k = 0; q < n; ++q) {
-            while (z[k + 1] < 2 * q)
-                ++k;
 
-//            m[q * incm] = v[k];
-            m[q * incm] = v[k] ;
-        }
+    if (t.size() < 3 * maxDim) {
+        t.resize(3 * maxDim);
+        lines.resize(maxDim * CellKernels::DTLanes);
+        transformed.resize(maxDim * CellKernels::DTLanes);
+        argmaxes.resize(maxDim * CellKernels::DTLanes);
+        distance.resize((maxDim + 1) * CellKernels::DTLanes);
+        index.resize(maxDim * CellKernels::DTLanes);
     }
 }
 
-//TODO init tmp1 and 2 in the function and allow b != 0
-// Tensor = convolution score of the parts in the scene
-void Model::DT3D(Tensor3DF & tensor, const Part & part, Tensor3DF & tmp1, Tensor3DF & tmp2,
-                 Positions * positions)
+void Model::DT3D(Tensor3DF & tensor, const Part & part, DTWorkspace & workspace, Position * positions)
 {
     // Nothing to do if the matrix is empty
     if (!tensor.size())
@@ -916,106 +922,69 @@ void Model::DT3D(Tensor3DF & tensor, const Part & part, Tensor3DF & tmp1, Tensor
     const int depths = static_cast<int>(tensor.depths());
     const int rows = static_cast<int>(tensor.rows());
     const int cols = static_cast<int>(tensor.cols());
+    const int maxDim = max(depths, max(rows, cols));
 
-    Tensor3DF copy(depths, rows, cols);
-    for (int z = 0; z < depths; ++z){
-        for (int y = 0; y < rows; ++y){
-            for (int x = 0; x < cols; ++x){
-                copy()(z, y, x) = tensor()(z, y, x);
-            }
-        }
-    }
-
-//    cout<<"Model::DT3D begin max : "<<copy.max()<<endl;
-//    cout<<"Model::DT3D begin min : "<<copy.min()<<endl;
-
-    if (positions){
-        (*positions)().resize(Eigen::array<long int, 3>{{depths, rows, cols}});
-//        (*positions)().setZero();
-    }
-
-    tmp1().resize(Eigen::array<long int, 3>{{depths, rows, cols}});
-    tmp2().resize(Eigen::array<long int, 3>{{depths, rows, cols}});
-
-    // Temporary vectors
-    int maxi = max(depths,max(rows, cols));
-    vector<GSHOTPyramid::Scalar> distance(maxi + 1);
-    vector<int> index(maxi + 1);
-    vector<GSHOTPyramid::Scalar> t(maxi);
+    // Temporary buffers, only grown when needed
+    workspace.reserve(depths * rows * cols, maxDim);
 
-    t[0] = numeric_limits<GSHOTPyramid::Scalar>::infinity();
-
-    for (int x = 1; x < cols; ++x){
-        t[x] = 1 / (part.deformation(0) * x);
-    }
-    //dt1d(const Scalar * x, int n, Scalar a, Scalar b, Scalar * z, int * v, Scalar * y,
-    //int * m, const Scalar * t, int incx, int incy, int incm)
-
-    // Filter the rows in tmp
-    for (int z = 0; z < depths; ++z){
-        for (int y = 0; y < rows; ++y){
-            dt1d<GSHOTPyramid::Scalar>(tensor().data() + y*cols + z*cols*rows, cols, part.deformation(0),
-                                 part.deformation(1), &distance[0], &index[0], tmp1().data() + y*cols + z*cols*rows,
-                                 positions ? ((*positions)().data() + y*cols + z*cols*rows)->data() + 2 : 0,
-                                 &t[0], 1, 1, 4);
-        }
-    }
+    GSHOTPyramid::Scalar * tmp1 = &workspace.tmp1[0];
+    GSHOTPyramid::Scalar * tmp2 = &workspace.tmp2[0];
+    GSHOTPyramid::Scalar * t = &workspace.t[0];
 
+    // Use lookup tables to replace the divisions along x, y and z
+    for (int i = 0; i < 3; ++i) {
+        t[i * maxDim] = numeric_limits<GSHOTPyramid::Scalar>::infinity();
 
-    for (int y = 1; y < rows; ++y){
-        t[y] = 1 / (part.deformation(2) * y);
-    }
-
-    // Filter the columns back to the original matrix
-    for (int z = 0; z < depths; ++z){
-        for (int x = 0; x < cols; ++x){
-            dt1d<GSHOTPyramid::Scalar>(tmp1().data() + x + z*cols*rows, rows, part.deformation(2), part.deformation(3),
-                                 &distance[0], &index[0],
-                                 tmp2().data() + x + z*cols*rows,
-                                 positions ? ((*positions)().data() + x + z*cols*rows)->data() + 1 : 0, &t[0],
-                                 cols, cols, 4 * cols);
-        }
+        for (int d = 1; d < maxDim; ++d)
+            t[i * maxDim + d] = 1 / (part.deformation(2 * i) * d);
     }
 
+    // Split the lines across threads, unless already called from a parallel loop (e.g. over the
+    // boxes of a pyramid)
+    const bool parallel = !omp_in_parallel() && (depths * rows * cols >= DTParallelSize);
+
+    #pragma omp parallel if (parallel)
+    {
+        // The first thread uses the given workspace, the others their own tiles
+        DTWorkspace local;
+        DTWorkspace & tiles = omp_get_thread_num() ? local : workspace;
+        tiles.reserve(0, maxDim);
+
+        // Filter the rows in tmp1
+        dtLines(tensor().data(), tmp1, positions ? positions->data() + 2 : 0,
+                depths * rows, depths * rows, 0, cols, cols, 1,
+                part.deformation(0), part.deformation(1), t, tiles);
+
+        // Filter the columns in tmp2
+        dtLines(tmp1, tmp2, positions ? positions->data() + 1 : 0,
+                depths * cols, cols, rows * cols, 1, rows, cols,
+                part.deformation(2), part.deformation(3), t + maxDim, tiles);
+
+        // Filter the depths back to the original tensor
+        dtLines(tmp2, tensor().data(), positions ? positions->data() : 0,
+                rows * cols, rows * cols, 0, 1, depths, rows * cols,
+                part.deformation(4), part.deformation(5), t + 2 * maxDim, tiles);
+
+        // Re-index the best x and y positions now that the best z changed
+        if (positions) {
+            #pragma omp for
+            for (int i = 0; i < depths * rows * cols; ++i) {
+                tmp1[i] = positions[i](2);
+                tmp2[i] = positions[i](1);
+            }
 
-    for (int z = 1; z < depths; ++z){
-        t[z] = 1 / (part.deformation(4) * z);
-    }
+            #pragma omp for
+            for (int z = 0; z < depths; ++z)
+                for (int y = 0; y < rows; ++y)
+                    for (int x = 0; x < cols; ++x) {
+                        Position & position = positions[(z * rows + y) * cols + x];
 
-    // Filter the columns back to the original matrix
-    for (int y = 0; y < rows; ++y){
-        for (int x = 0; x < cols; ++x){
-            dt1d<GSHOTPyramid::Scalar>(tmp2().data() + x + y*cols, depths, part.deformation(4), part.deformation(5),
-                                 &distance[0], &index[0],
-                                 tensor().data() + x + y*cols,//or 0
-                                 positions ? ((*positions)().data() + x + y*cols)->data() : 0, &t[0],
-                                 cols * rows, cols * rows, 4 * cols * rows);
+                        // The best y given the best z, then the best x given both
+                        position(1) = tmp2[(position(0) * rows + y) * cols + x];
+                        position(2) = tmp1[(position(0) * rows + position(1)) * cols + x];
+                    }
         }
     }
-
-//    // Re-index the best z positions now that the best x and y changed
-    if (positions) {
-        for (int z = 0; z < depths; ++z)
-            for (int y = 0; y < rows; ++y)
-                for (int x = 0; x < cols; ++x){
-                    tmp1()(z, y, x) = (*positions)()(z, y, x)(2);
-                    tmp2()(z, y, x) = (*positions)()(z, y, x)(1);
-                }
-
-        for (int z = 0; z < depths; ++z)
-            for (int y = 0; y < rows; ++y)
-                for (int x = 0; x < cols; ++x){
-
-                    (*positions)()(z, y, x)(2) = tmp1()( (*positions)()(z, y, x)(0), (*positions)()(z, y, x)(1), x);
-                    (*positions)()(z, y, x)(1) = tmp2()((*positions)()(z, y, x)(0), y, (*positions)()(z, y, x)(2));
-                }
-
-    }
-
-//    cout<<"Model::DT3D end max : "<<tensor.max()<<endl;
-//    cout<<"Model::DT3D end min : "<<tensor.min()<<endl;
-
-
 }
 
 ostream & FFLD::operator<<(ostream & os, const Model & model)
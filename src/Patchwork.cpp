@@ -0,0 +1,214 @@
+#include "Patchwork.h"
+
+#include <set>
+
+using namespace Eigen;
+using namespace FFLD;
+using namespace std;
+
+Patchwork::Patchwork(const GSHOTPyramid & pyramid) : pyramid_(pyramid)
+{
+	set<Size> sizes;
+	
+	for (int lvl = 0; lvl < pyramid.levels().size(); ++lvl)
+		for (int box = 0; box < pyramid.levels()[lvl].size(); ++box)
+			sizes.insert(Size(pyramid.levels()[lvl][box].depths(),
+							  pyramid.levels()[lvl][box].rows(),
+							  pyramid.levels()[lvl][box].cols()));
+	
+	sizes_.assign(sizes.begin(), sizes.end());
+}
+
+const vector<Patchwork::Size> & Patchwork::sizes() const
+{
+	return sizes_;
+}
+
+void Patchwork::transformFilters(vector<Filter> & filters) const
+{
+#pragma omp parallel for
+	for (int i = 0; i < filters.size(); ++i) {
+		const GSHOTPyramid::Level & filter = filters[i].filter;
+		
+		// 1x1x1 filters are never transformed (see Patchwork::convolve)
+		if (filter.size() <= 1)
+			continue;
+		
+		for (int j = 0; j < sizes_.size(); ++j) {
+			const Size & size = sizes_[j];
+			
+			if ((get<0>(size) < filter.depths()) || (get<1>(size) < filter.rows()) ||
+				(get<2>(size) < filter.cols()) || filters[i].spectra.count(size))
+				continue;
+			
+			Transform(filter, size, filters[i].spectra[size]);
+		}
+	}
+}
+
+void Patchwork::convolve(const vector<Filter> & filters,
+						 vector<vector<vector<Tensor3DF> > > & convolutions) const
+{
+	const int nbFilters = static_cast<int>(filters.size());
+	const int nbLevels = static_cast<int>(pyramid_.levels().size());
+	
+	convolutions.resize(nbFilters);
+	
+	for (int i = 0; i < nbFilters; ++i) {
+		convolutions[i].resize(nbLevels);
+		
+		for (int lvl = 0; lvl < nbLevels; ++lvl)
+			convolutions[i][lvl].resize(pyramid_.levels()[lvl].size());
+	}
+	
+	// A 1x1x1 filter is a dot product per cell, faster without transforms (and scored at once for
+	// all the boxes of a level of single cells)
+	vector<const GSHOTPyramid::Level *> unitFilters;
+	vector<int> unitIndices;
+	
+	for (int i = 0; i < nbFilters; ++i) {
+		if (filters[i].filter.size() == 1) {
+			unitFilters.push_back(&filters[i].filter);
+			unitIndices.push_back(i);
+		}
+	}
+	
+	if (!unitFilters.empty()) {
+		vector<vector<vector<Tensor3DF> > > unitConvolutions;
+		pyramid_.convolve(unitFilters, unitConvolutions);
+		
+		for (int i = 0; i < unitIndices.size(); ++i)
+			convolutions[unitIndices[i]].swap(unitConvolutions[i]);
+	}
+	
+	for (int lvl = 0; lvl < nbLevels; ++lvl) {
+#pragma omp parallel for
+		for (int box = 0; box < pyramid_.levels()[lvl].size(); ++box) {
+			const GSHOTPyramid::Level & level = pyramid_.levels()[lvl][box];
+			const Size size(level.depths(), level.rows(), level.cols());
+			
+			Spectrum spectrum;
+			VectorXcf sum;
+			vector<Scalar> buffer;
+			
+			for (int i = 0; i < nbFilters; ++i) {
+				const GSHOTPyramid::Level & filter = filters[i].filter;
+				
+				// Nothing to do if the level is smaller than the filter, 1x1x1 filters are done
+				if ((level.depths() < filter.depths()) || (level.rows() < filter.rows()) ||
+					(level.cols() < filter.cols()) || (filter.size() <= 1))
+					continue;
+				
+				map<Size, Spectrum>::const_iterator it = filters[i].spectra.find(size);
+				
+				if (it == filters[i].spectra.end()) {
+					cerr << "Patchwork::convolve filter " << i << " not transformed at the size of box "
+						 << box << endl;
+					continue;
+				}
+				
+				// Transform the box only once for all the filters
+				if (!spectrum.size())
+					Transform(level, size, spectrum);
+				
+				// Sum the products of all the channels, conjugated for a correlation
+				sum = spectrum.cwiseProduct(it->second.conjugate()).rowwise().sum();
+				
+				buffer.resize(level.size());
+				fftwf_execute_dft_c2r(Plans(size).second, reinterpret_cast<fftwf_complex *>(sum.data()),
+									  buffer.data());
+				
+				// Keep the valid part of the (circular) correlation, FFTW does not normalize
+				const int depths = level.depths() - filter.depths() + 1;
+				const int rows = level.rows() - filter.rows() + 1;
+				const int cols = level.cols() - filter.cols() + 1;
+				const Scalar scale = Scalar(1) / level.size();
+				
+				Tensor3DF & convolution = convolutions[i][lvl][box];
+				convolution = Tensor3DF(depths, rows, cols);
+				
+				for (int z = 0; z < depths; ++z)
+					for (int y = 0; y < rows; ++y)
+						for (int x = 0; x < cols; ++x)
+							convolution()(z, y, x) =
+								buffer[(z * level.rows() + y) * level.cols() + x] * scale;
+			}
+		}
+	}
+}
+
+void Patchwork::TransformFilter(const GSHOTPyramid::Level & filter, Filter & result)
+{
+	result.filter = filter;
+	result.spectra.clear();
+}
+
+pair<fftwf_plan, fftwf_plan> Patchwork::Plans(const Size & size)
+{
+	static map<Size, pair<fftwf_plan, fftwf_plan> > plans;
+	
+	pair<fftwf_plan, fftwf_plan> result(0, 0);
+	
+	// The FFTW planner is not thread safe, the execution of a plan is
+#pragma omp critical(fftw)
+	{
+		map<Size, pair<fftwf_plan, fftwf_plan> >::const_iterator it = plans.find(size);
+		
+		if (it != plans.end()) {
+			result = it->second;
+		}
+		else {
+			const int n[3] = {get<0>(size), get<1>(size), get<2>(size)};
+			const int nbReals = n[0] * n[1] * n[2];
+			const int nbComplexes = n[0] * n[1] * (n[2] / 2 + 1);
+			
+			float * reals = fftwf_alloc_real(nbReals * GSHOTPyramid::DescriptorSize);
+			fftwf_complex * complexes = fftwf_alloc_complex(nbComplexes * GSHOTPyramid::DescriptorSize);
+			
+			// The plans are executed on other (unaligned) arrays with the new-array execute functions
+			result.first = fftwf_plan_many_dft_r2c(3, n, GSHOTPyramid::DescriptorSize,
+												   reals, 0, GSHOTPyramid::DescriptorSize, 1,
+												   complexes, 0, GSHOTPyramid::DescriptorSize, 1,
+												   FFTW_ESTIMATE | FFTW_UNALIGNED);
+			result.second = fftwf_plan_dft_c2r_3d(n[0], n[1], n[2], complexes, reals,
+												  FFTW_ESTIMATE | FFTW_UNALIGNED);
+			
+			fftwf_free(reals);
+			fftwf_free(complexes);
+			
+			plans[size] = result;
+		}
+	}
+	
+	return result;
+}
+
+void Patchwork::Transform(const GSHOTPyramid::Level & level, const Size & size, Spectrum & result)
+{
+	const int depths = get<0>(size);
+	const int rows = get<1>(size);
+	const int cols = get<2>(size);
+	
+	result.resize(depths * rows * (cols / 2 + 1), GSHOTPyramid::DescriptorSize);
+	
+	// The channels of the cells are interleaved, exactly as FFTW expects them
+	const Scalar * data = reinterpret_cast<const Scalar *>(level().data());
+	vector<Scalar> padded;
+	
+	if ((level.depths() != depths) || (level.rows() != rows) || (level.cols() != cols)) {
+		padded.resize(depths * rows * cols * GSHOTPyramid::DescriptorSize, 0);
+		
+		const int rowSize = level.cols() * GSHOTPyramid::DescriptorSize;
+		
+		for (int z = 0; z < level.depths(); ++z)
+			for (int y = 0; y < level.rows(); ++y)
+				copy(data + (z * level.rows() + y) * rowSize, data + (z * level.rows() + y + 1) * rowSize,
+					 padded.begin() + (z * rows + y) * cols * GSHOTPyramid::DescriptorSize);
+		
+		data = &padded[0];
+	}
+	
+	// An out-of-place real to complex transform does not modify its input
+	fftwf_execute_dft_r2c(Plans(size).first, const_cast<Scalar *>(data),
+						  reinterpret_cast<fftwf_complex *>(result.data()));
+}
@@ -0,0 +1,174 @@
+#include "SceneCache.h"
+
+using namespace FFLD;
+using namespace std;
+
+const size_t SceneCache::DefaultBudget;
+
+SceneCache::SceneCache(size_t budget) : budget_(budget), bytes_(0)
+{
+}
+
+SceneCache::SceneCache(const SceneCache & cache) : budget_(cache.budget_), bytes_(cache.bytes_),
+entries_(cache.entries_), lru_(cache.lru_)
+{
+	// The copied iterators point into the list of the other cache
+	for (list<string>::iterator it = lru_.begin(); it != lru_.end(); ++it)
+		entries_[*it].lru = it;
+}
+
+SceneCache & SceneCache::operator=(const SceneCache & cache)
+{
+	if (this != &cache) {
+		budget_ = cache.budget_;
+		bytes_ = cache.bytes_;
+		entries_ = cache.entries_;
+		lru_ = cache.lru_;
+		
+		for (list<string>::iterator it = lru_.begin(); it != lru_.end(); ++it)
+			entries_[*it].lru = it;
+	}
+	
+	return *this;
+}
+
+size_t SceneCache::budget() const
+{
+	return budget_;
+}
+
+void SceneCache::setBudget(size_t budget)
+{
+	budget_ = budget;
+	evict();
+}
+
+size_t SceneCache::bytes() const
+{
+	return bytes_;
+}
+
+PointCloudPtr SceneCache::cloud(const string & filename)
+{
+	const string key = "cloud " + filename;
+	map<string, Entry>::iterator it = entries_.find(key);
+	
+	if (it != entries_.end()) {
+		touch(it->second);
+		return it->second.cloud;
+	}
+	
+	PointCloudPtr cloud(new PointCloudT);
+	
+	if (readPointCloud(filename, cloud) == -1)
+		return PointCloudPtr();
+	
+	Entry entry;
+	entry.cloud = cloud;
+	entry.bytes = Bytes(*cloud);
+	insert(key, entry);
+	
+	return cloud;
+}
+
+SceneCache::PyramidConstPtr SceneCache::pyramid(const string & key)
+{
+	map<string, Entry>::iterator it = entries_.find("pyramid " + key);
+	
+	if (it == entries_.end())
+		return PyramidConstPtr();
+	
+	touch(it->second);
+	return it->second.pyramid;
+}
+
+void SceneCache::insert(const string & key, PyramidConstPtr pyramid)
+{
+	if (!pyramid)
+		return;
+	
+	Entry entry;
+	entry.pyramid = pyramid;
+	entry.bytes = Bytes(*pyramid);
+	insert("pyramid " + key, entry);
+}
+
+void SceneCache::clear()
+{
+	entries_.clear();
+	lru_.clear();
+	bytes_ = 0;
+}
+
+size_t SceneCache::Bytes(const PointCloudT & cloud)
+{
+	return sizeof(cloud) + cloud.size() * sizeof(PointType);
+}
+
+size_t SceneCache::Bytes(const GSHOTPyramid & pyramid)
+{
+	size_t bytes = sizeof(pyramid);
+	
+	for (int lvl = 0; lvl < pyramid.levels_.size(); ++lvl)
+		for (int box = 0; box < pyramid.levels_[lvl].size(); ++box)
+			bytes += sizeof(GSHOTPyramid::Level) +
+					 pyramid.levels_[lvl][box].size() * sizeof(GSHOTPyramid::Cell);
+	
+	for (int lvl = 0; lvl < pyramid.keyPts_.size(); ++lvl) {
+		for (int box = 0; box < pyramid.keyPts_[lvl].size(); ++box)
+			if (pyramid.keyPts_[lvl][box])
+				bytes += Bytes(*pyramid.keyPts_[lvl][box]);
+		
+		if (lvl < pyramid.rectangles_.size())
+			bytes += pyramid.rectangles_[lvl].size() * (sizeof(Rectangle) + 8 * sizeof(PointType));
+	}
+	
+	if (pyramid.globalKeyPts)
+		bytes += Bytes(*pyramid.globalKeyPts);
+	
+	if (pyramid.globalDescriptors)
+		bytes += pyramid.globalDescriptors->size() * sizeof(DescriptorType);
+	
+	// The search tree roughly needs as much memory as the surface itself
+	if (pyramid.surface_)
+		bytes += 2 * Bytes(*pyramid.surface_);
+	
+	if (pyramid.surfaceNormals_)
+		bytes += pyramid.surfaceNormals_->size() * sizeof(NormalType);
+	
+	return bytes;
+}
+
+void SceneCache::touch(Entry & entry)
+{
+	lru_.splice(lru_.begin(), lru_, entry.lru);
+}
+
+void SceneCache::insert(const string & key, Entry entry)
+{
+	map<string, Entry>::iterator it = entries_.find(key);
+	
+	if (it != entries_.end()) {
+		bytes_ -= it->second.bytes;
+		lru_.erase(it->second.lru);
+		entries_.erase(it);
+	}
+	
+	lru_.push_front(key);
+	entry.lru = lru_.begin();
+	entries_[key] = entry;
+	bytes_ += entry.bytes;
+	
+	evict();
+}
+
+void SceneCache::evict()
+{
+	while (bytes_ > budget_ && !lru_.empty()) {
+		map<string, Entry>::iterator it = entries_.find(lru_.back());
+		
+		bytes_ -= it->second.bytes;
+		entries_.erase(it);
+		lru_.pop_back();
+	}
+}
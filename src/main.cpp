@@ -251,9 +251,9 @@ public:
         // Compute the scores
         vector<Detection> detections;
 
-        vector<vector<Tensor3DF> >scores;
+        vector<Tensor3DPackF> scores;
         vector<Mixture::Indices> argmaxes;
-        vector<vector<vector<vector<Model::Positions> > > >positions;
+        vector<vector<vector<Model::LevelPositions> > >positions;
 
 
         mixture.computeScores( pyramid, scores, argmaxes, &positions);
@@ -271,7 +271,7 @@ public:
         for (int lvl = 0; lvl < scores.size(); ++lvl) {
             for (int box = 0; box < scores[lvl].size(); ++box) {
                 if(scores[lvl][box].size() > 0){
-                    const double score = scores[lvl][box]()(0,0,0);
+                    const double score = scores[lvl][box](0,0,0);
                     if( score > maxScore) maxScore = score;
                     if( score < minScore) minScore = score;
                 }
@@ -285,9 +285,9 @@ public:
 
                 if(scores[lvl][box].size() > 0){
                     ofstream out("conv.txt");
-                    out << scores[lvl][box]();
+                    out << scores[lvl][box].copy()();
 
-                    const double score = scores[lvl][box]()(0,0,0);
+                    const double score = scores[lvl][box](0,0,0);
 
 //                    cout<<"test:: scores = "<<score<<endl;
 
@@ -384,9 +384,17 @@ public:
 
             GSHOTPyramid pyramid(mixture.models()[0].boxSize_,
                     mixture.models()[0].parts().size(), interval, sceneResolution);
+            const string cachePath = GSHOTPyramid::CachePath(scenes[i].filename(), sceneResolution,
+                    mixture.models()[0].boxSize_, mixture.models()[0].parts().size(), interval,
+                    pyramid.nbOctave_, 40);
 //            pyramid.createFilteredPyramid(cloud, mixture.models()[0].parts()[0].filter,
 //                    min, max, 0.35, 40);
-            pyramid.createFullPyramid(cloud, min, max, 40);
+            if (cachePath.empty() || !pyramid.load(cachePath)) {
+                pyramid.createFullPyramid(cloud, min, max, 40);
+                if (!cachePath.empty()) {
+                    pyramid.save(cachePath);
+                }
+            }
 //            PointCloudPtr test (new PointCloudT(1,1,PointType()));
 //            int boxNb = 0;//5+3*12+5*12*7;//700;449//403;145;43
 //            test->points[0] = pyramid.globalKeyPts->points[boxNb];
@@ -1121,9 +1129,9 @@ public:
         Model::Positions positions;
         Model::Part part;
         part.deformation << -0.01, 0.0, -0.01, 0.0, -0.01, 0.0, -0.01, 0.0;
-        Tensor3DF tmp1;
-        Tensor3DF tmp2;
-        Model::DT3D( score, part, tmp1, tmp2, &positions);
+        Model::DTWorkspace workspace;
+        positions().resize(Eigen::array<long int, 3>{{score.depths(), score.rows(), score.cols()}});
+        Model::DT3D( score, part, workspace, positions().data());
         cout << "new score : "<<endl<<score()<<endl;
         cout << "positions : "<<endl;
         for( int i = 0; i<score.depths(); ++i){
@@ -1181,13 +1189,18 @@ public:
 };
 
 
-int main(){
+int main(int argc, char * argv[]){
     //Turn pcl message to OFF !!!!!!!!!!!!!!!!!!!!
     pcl::console::setVerbosityLevel(pcl::console::L_ALWAYS);
 
 
     Test test;
 
+    // The pyramids are cached on disk in the directory given as first argument, if any, and are
+    // rebuilt only when the scene or the pyramid parameters change
+    if (argc > 1)
+        GSHOTPyramid::SetCacheDirectory(argv[1]);
+
     int start = getMilliCount();
 
 //    vector<Scene> trainScenes = test.getScenes( "/media/ubuntu/DATA/3DDataset/sceneNNTrain/");